@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ucontext.h>
+#include <bios.h>
+
+/*
+	A microbenchmark for the context switch of bios.h.
+
+	Two contexts swap back and forth ROUNDS times, first with
+	cpu_swap_context() and then with the ucontext(3) swapcontext(),
+	and the average cost of one switch is printed for each.
+
+	Usage:  bench_switch [rounds]
+ */
+
+#define STACK_SIZE (64*1024)
+
+static long ROUNDS = 1000000;
+
+static double now_nsec()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return 1E9*t.tv_sec + t.tv_nsec;
+}
+
+
+/* bios.h contexts */
+static cpu_context_t bios_main, bios_coro;
+
+static void bios_coro_func()
+{
+	for(;;)
+		cpu_swap_context(&bios_coro, &bios_main);
+}
+
+static double bench_bios()
+{
+	void* stack = malloc(STACK_SIZE);
+	cpu_initialize_context(&bios_coro, stack, STACK_SIZE, bios_coro_func);
+
+	double t0 = now_nsec();
+	for(long i=0; i<ROUNDS; i++)
+		cpu_swap_context(&bios_main, &bios_coro);
+	double t1 = now_nsec();
+
+	free(stack);
+	return (t1-t0) / (2.0*ROUNDS);
+}
+
+
+/* ucontext contexts */
+static ucontext_t uc_main, uc_coro;
+
+static void uc_coro_func()
+{
+	for(;;)
+		swapcontext(&uc_coro, &uc_main);
+}
+
+static double bench_ucontext()
+{
+	void* stack = malloc(STACK_SIZE);
+	getcontext(&uc_coro);
+	uc_coro.uc_link = NULL;
+	uc_coro.uc_stack.ss_sp = stack;
+	uc_coro.uc_stack.ss_size = STACK_SIZE;
+	uc_coro.uc_stack.ss_flags = 0;
+	makecontext(&uc_coro, uc_coro_func, 0);
+
+	double t0 = now_nsec();
+	for(long i=0; i<ROUNDS; i++)
+		swapcontext(&uc_main, &uc_coro);
+	double t1 = now_nsec();
+
+	free(stack);
+	return (t1-t0) / (2.0*ROUNDS);
+}
+
+
+int main(int argc, char** argv)
+{
+	if(argc>1) ROUNDS = atol(argv[1]);
+	if(ROUNDS<=0) {
+		fprintf(stderr, "Usage: %s [rounds]\n", argv[0]);
+		return 1;
+	}
+
+#ifdef BIOS_FAST_CONTEXT
+	const char* impl = "fast";
+#else
+	const char* impl = "ucontext";
+#endif
+
+	printf("%ld rounds\n", ROUNDS);
+	printf("cpu_swap_context (%s): %8.1f nsec/switch\n", impl, bench_bios());
+	printf("swapcontext             : %8.1f nsec/switch\n", bench_ucontext());
+	return 0;
+}
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <stdint.h>
 #include <pthread.h>
@@ -8,7 +9,7 @@
 #include <sys/select.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/signalfd.h>
 #include <sys/sysinfo.h>
 #include <unistd.h>
@@ -18,16 +19,25 @@
 #include "util.h"
 #include "bios.h"
 
+/* Older glibc headers do not name the thread id of a sigevent */
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
 /*
 	Implementation of bios.h API
 
 
 	Basic idea:
 	- Each core is simulated by a pthread
-	- One POSIX timer per core thread
+	- One POSIX timer per core thread, which sends SIGUSR1 directly
+	to the core thread (SIGEV_THREAD_ID).
 	- Core threads mask all signals except for USR1.
-	- The PIC thread receives all signals and dispatches them to
-	the right core thread by raising SIGUSR1.
+	- The PIC thread receives the signals of the devices and dispatches
+	them to the right core thread by raising SIGUSR1.
+	- Interrupts are disabled by a per-core flag, not by masking SIGUSR1.
+	A SIGUSR1 that arrives while the flag is set leaves its interrupt
+	pending, and cpu_enable_interrupts() dispatches it.
 
  */
 
@@ -50,6 +60,8 @@ typedef struct core
 	timer_t timer_id;
 
 	volatile uint32_t intr_pending;
+	volatile uint32_t serial_pending;	/* devices that raised interrupts, by device id */
+	volatile sig_atomic_t intr_disabled;
 	interrupt_handler* intvec[maximum_interrupt_no];
 
 
@@ -73,9 +85,6 @@ static sigset_t core_signal_set;
 /* Uset to store the singleton set containing SIGUSR1 */
 static sigset_t sigusr1_set;
 
-/* Uset to store the singleton set containing SIGALRM */
-static sigset_t sigalrm_set;
-
 /* Used to create the signalfd */
 static sigset_t signalfd_set;
 
@@ -103,9 +112,6 @@ static struct sigaction USR1_saved_sigaction;
 /* The sigaction for SIGUSR1 (core interrupts) */
 static struct sigaction USR1_sigaction;
 
-/* This gives a rough serial port timeout of 300 msec */
-#define SERIAL_TIMEOUT 300000
-
 /* Forward decl. of per-core signal handler */
 static void sigusr1_handler(int signo, siginfo_t* si, void* ctx);
 
@@ -123,7 +129,8 @@ static void initialize()
 	physical_cores = get_nprocs();
 
 	USR1_sigaction.sa_sigaction = sigusr1_handler;
-	USR1_sigaction.sa_flags = SA_SIGINFO;
+	/* SIGUSR1 must stay unblocked in the handler, which may switch context */
+	USR1_sigaction.sa_flags = SA_SIGINFO | SA_NODEFER;
 	sigemptyset(& USR1_sigaction.sa_mask);
 
 	/* Create the sigmask to block all signals, except USR1 */
@@ -134,15 +141,9 @@ static void initialize()
 	CHECK(sigemptyset(&sigusr1_set));
 	CHECK(sigaddset(&sigusr1_set, SIGUSR1));
 
-	/* Create the mask for  SIGALRM */
-	CHECK(sigemptyset(&sigalrm_set));
-	CHECK(sigaddset(&sigalrm_set, SIGALRM));
-
-
 	/* Create signaldf_set */
 	CHECK(sigemptyset(&signalfd_set));
 	CHECK(sigaddset(&signalfd_set, SIGUSR1));
-	CHECK(sigaddset(&signalfd_set, SIGALRM));
 }
 
 
@@ -180,6 +181,8 @@ static void* core_thread(void* _core)
 
 	/* Clear pending bitvec */
 	core->intr_pending = 0;
+	core->serial_pending = 0;
+	core->intr_disabled = 0;
 
 	/* Default interrupt handlers */
 	for(int i=0; i<maximum_interrupt_no; i++) 
@@ -190,9 +193,13 @@ static void* core_thread(void* _core)
 	/* Set core signal mask */
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &core_signal_set, NULL));
 
-	/* create a thread-specific timer */
-	core->timer_sigevent.sigev_notify = SIGEV_SIGNAL;
-	core->timer_sigevent.sigev_signo = SIGALRM;
+	/* 
+		Create a thread-specific timer. It interrupts this thread directly, 
+		and sigusr1_handler() tells its signal by the SI_TIMER code.
+	 */
+	core->timer_sigevent.sigev_notify = SIGEV_THREAD_ID;
+	core->timer_sigevent.sigev_notify_thread_id = gettid();
+	core->timer_sigevent.sigev_signo = SIGUSR1;
 	core->timer_sigevent.sigev_value.sival_int = core->id;
 	// Could also be CLOCK_REALTIME
 	CHECK(timer_create(CLOCK_MONOTONIC, & core->timer_sigevent, & core->timer_id));
@@ -342,6 +349,22 @@ static inline void dispatch_interrupts(Core* core)
 }
 
 
+/*
+	A SIGUSR1 sent by the core timer raises the ALARM interrupt.
+	There is no need to signal the core, it is being signalled.
+ */
+static inline void timer_signal(Core* core, siginfo_t* si)
+{
+	if(si->si_code == SI_TIMER) {
+#if defined(CORE_STATISTICS)
+		if(! intr_fetch_set(core, ALARM)) core->irq_raised[ALARM] ++;
+#else
+		intr_fetch_set(core, ALARM);
+#endif
+	}
+}
+
+
 /*
 	This is the signal handler for core threads, to handle interrupts.
  */
@@ -353,7 +376,17 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 	core->irq_count++;
 #endif
 
+	timer_signal(core, si);
+
+	/* Interrupts are disabled, leave them pending */
+	if(core->intr_disabled) return;
+
+	core->intr_disabled = 1;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
 	dispatch_interrupts(core);
+
+	/* We may be on a different core now */
+	cpu_enable_interrupts();
 }
 
 
@@ -386,9 +419,9 @@ static TimerDuration get_coarse_time()
 	by this program (bidirectional fds, such as sockets, can be handled by a pair of
 	io_device objects).  
 
-	An io_device is ready if I/O operations may succeed (as reported by select()).
+	An io_device is ready if I/O operations may succeed (as reported by epoll).
 
-	A not-ready device is made ready when select() returns it as such.
+	A not-ready device is made ready when epoll reports it as such.
 
 	A ready device is made not-ready on each failed attempt to do an I/O transfer.
 
@@ -406,17 +439,31 @@ typedef enum io_direction
 /*
 	An io_device is a file descriptor from which we either read or write bytes.
  */
+#define IO_BUFFER_SIZE 4096
+
 typedef struct io_device
 {
 	int fd;              		/* file descriptor */
 	io_direction iodir;  		/* device direction */
+	uint id;             		/* index of the device in the PIC */
 
 	Core* volatile int_core;	/* core to receive interrupts */
 	volatile int ready;  		/* ready flag */
-	TimerDuration last_int;	    /* used by PIC for timeouts */
+
+	/* Received bytes not yet transferred (RX only), under lock */
+	pthread_spinlock_t lock;
+	uint bufpos, buflen;
+	char buffer[IO_BUFFER_SIZE];
 } io_device;
 
 
+/*
+	Devices to be re-armed by the PIC, one bit per device id.
+	The kbd of terminal i has id 2i and its con has id 2i+1.
+ */
+static _Atomic uint32_t pic_rearm;
+
+
 /*
 	Determine device readiness without blocking
  */
@@ -431,33 +478,30 @@ static int io_device_ready(int fd, io_direction dir) {
 
 
 /*
-	Check that the a device is connected and in a good state.
+	A transfer found the device not ready. Ask the PIC to re-arm it,
+	unless a request is already pending.
  */
-static int io_device_check(io_device* dev)
+static void io_device_not_ready(io_device* this)
 {
-	struct pollfd fds = { .fd=dev->fd, .events=POLLIN };
-	int rc;
-	do {
-		rc=poll(&fds, 1, 0);
-	} while( rc == -1 && errno==EINTR );
-	CHECK(rc);
-	rc = (fds.revents & (POLLHUP|POLLERR))==0;
-	assert(rc);
-	return rc;
+	this->ready = 0;
+	uint32_t mask = 1u << this->id;
+	if((__atomic_fetch_or(& pic_rearm, mask, __ATOMIC_SEQ_CST) & mask) == 0)
+		interrupt_pic_thread();
 }
 
 
-
 /*
 	Initialize device
  */
-static void io_device_init(io_device* this, int fd, io_direction iodir)
+static void io_device_init(io_device* this, int fd, io_direction iodir, uint id)
 {
 	this->fd = fd;
 	this->iodir = iodir;
+	this->id = id;
 	this->int_core = &CORE[0];
 	this->ready = io_device_ready(fd, iodir);
-	this->last_int = get_coarse_time();
+	this->bufpos = this->buflen = 0;
+	CHECKRC(pthread_spin_init(& this->lock, PTHREAD_PROCESS_PRIVATE));
 
 	/* Set file descriptor to non-blocking */
 	CHECK(fcntl(fd, F_SETFL, O_NONBLOCK));
@@ -471,46 +515,79 @@ static int io_device_destroy(io_device* this)
 	int rc;
 	while((rc = close(this->fd))==-1 && errno==EINTR);
 	if(rc==-1) perror("io_device_destroy: ");
+	CHECKRC(pthread_spin_destroy(& this->lock));
 	return rc;
 }
 
 
-static int io_device_read(io_device* this, char* ptr)
+/*
+	Transfer up to size bytes. Bytes are read from the fd a buffer at a
+	time, so that a transfer of a few bytes does not cost a syscall.
+	The device is not ready when the buffer is empty and the fd has 
+	nothing to read.
+
+	Cores may read concurrently, so the buffer is locked. Interrupts are
+	disabled meanwhile, so that a handler on this core cannot spin on it.
+ */
+static uint io_device_read(io_device* this, char* ptr, uint size)
 {
 	assert(this->iodir == IODIR_RX);
-	int rc;
-	while((rc=read(this->fd, ptr, 1))==-1 && errno == EINTR);
 
-	int ok = rc==0 || rc==1 || (rc==-1 && (errno==EAGAIN || errno==EWOULDBLOCK));
-	if(!ok) perror("io_device_read:");
-	assert(ok);
+	uint n = 0;
+	int intr = cpu_disable_interrupts();
+	pthread_spin_lock(& this->lock);
 
-	if(rc!=1 && this->ready) {
-		this->ready = 0;
-		interrupt_pic_thread();
+	if(this->bufpos == this->buflen) {
+		int rc;
+		while((rc=read(this->fd, this->buffer, IO_BUFFER_SIZE))==-1 && errno == EINTR);
+
+		int ok = rc>=0 || (rc==-1 && (errno==EAGAIN || errno==EWOULDBLOCK));
+		if(!ok) perror("io_device_read:");
+		assert(ok);
+
+		if(rc<=0) {
+			if(this->ready)
+				io_device_not_ready(this);
+			goto finish;
+		}
+		this->bufpos = 0;
+		this->buflen = rc;
 	}
-	return rc==1;
+
+	n = this->buflen - this->bufpos;
+	if(n > size) n = size;
+	memcpy(ptr, this->buffer + this->bufpos, n);
+	this->bufpos += n;
+
+finish:
+	pthread_spin_unlock(& this->lock);
+	if(intr) cpu_enable_interrupts();
+	return n;
 }
 
 
-static int io_device_write(io_device* this, char value)
+/*
+	Transfer up to size bytes, with a single write.
+ */
+static uint io_device_write(io_device* this, const char* ptr, uint size)
 {
 	assert(this->iodir == IODIR_TX);
 
 	/* Try to write */
 	int rc;
-	while((rc = write(this->fd, &value, 1))==-1 && errno == EINTR);
+	while((rc = write(this->fd, ptr, size))==-1 && errno == EINTR);
 
-	int ok = rc==1 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE));
+	int ok = rc>0 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE));
 	if(! ok) perror("io_device_write:");
 	assert(ok);
 
-	if(rc!=1 && this->ready) {
-		this->ready = 0;
-		interrupt_pic_thread();
-	} 
+	if(rc<=0) {
+		if(this->ready)
+			io_device_not_ready(this);
+		return 0;
+	}
 
-	return rc==1;
+	return rc;
 }
 
 
@@ -536,8 +613,9 @@ static uint nterm = 0;
  */
 static void terminal_init(terminal* this, int fdin, int fdout)
 {
-	io_device_init(& this->kbd, fdin, IODIR_RX);
-	io_device_init(& this->con, fdout, IODIR_TX);
+	uint i = this - TERM;
+	io_device_init(& this->kbd, fdin, IODIR_RX, 2*i);
+	io_device_init(& this->con, fdout, IODIR_TX, 2*i+1);
 }
 
 /*
@@ -557,27 +635,28 @@ static int terminal_destroy(terminal* this)
 	The PIC daemon dispatches interrupts to core threads,
 	by calling raise_interrupt().
 
-	Interrupts sent include
-	(a) ALARM, when the core timer expires
-	(b) SERIAL_RX_READY  &  SERIAL_TX_READY, when some 
-		io_device becomes ready.
+	Interrupts sent are SERIAL_RX_READY & SERIAL_TX_READY, when some 
+	io_device becomes ready. The ALARM interrupt does not go through 
+	the PIC, the core timers signal their cores directly.
 
 	Implementation:
-	- Use Linux signal file descriptors to receive signals. Currently,
-	  two signals are used:
+	- Use a Linux signal file descriptor to receive signals. Currently,
+	  one signal is used:
 	  * SIGUSR1 is sent by io_device to signify that some io_device is NOT READY.
-	    Otherwise it is discarded. The signal simply wakes up the PIC_daemon thread.
-	    This however causes the PIC loop to include the devices to the ones monitored.
-
-	  * SIGALRM is sent to indicate that some core timer has expired. This
-	    results to an interrupt on the core.
-
-	- Monitor these fds together with the fds of the terminals.
+	    Otherwise it is discarded. The signal simply wakes up the PIC_daemon thread,
+	    which re-arms the devices marked in pic_rearm.
+
+	- Monitor this fd together with the fds of the terminals, in a
+	  persistent epoll set. All fds are registered edge-triggered, so an
+	  event means that an fd may have become ready, and a device that is 
+	  ready ignores its events. 
+	  
+	  Re-arming a device (EPOLL_CTL_MOD) makes epoll check the fd again, 
+	  so an event that came before the device was marked not ready is 
+	  not lost. Thus, there is no periodic wakeup.
 	
-	- At each loop dispatch interrupts as needed:
-	  * ALARM interrupts to those cores whose timer has expired
-	  * SERIAL_RX/TX_READY to those cores handling the interrupts of
-	    an io_device which is now READY.		
+	- At each loop, dispatch SERIAL_RX/TX_READY to those cores handling 
+	  the interrupts of an io_device which is now READY.		
  */
 
 
@@ -627,87 +706,67 @@ static void close_signalfd(int sfd)
 
  ********************************/
 
-typedef struct pic_selector
-{
-	fd_set fds[2];
-	int maxfd;
-	TimerDuration system_clock;
-} pic_selector;
-
-
-static void pic_selector_reset(pic_selector* ps)
-{
-	FD_ZERO(& ps->fds[0]);
-	FD_ZERO(& ps->fds[1]);
-	ps->maxfd = 0;
-}
-
+/* The epoll set of the PIC */
+static int pic_epollfd;
 
-static inline void pic_add_fd(pic_selector* ps, io_direction dir, int fd)
-{
-	FD_SET(fd, ps->fds + dir);
-	if(fd >= ps->maxfd) ps->maxfd = fd+1;
-}
+/* The id of the signal fd in the epoll set, after the device ids */
+#define PIC_SIGUSR1_ID (2*MAX_TERMINALS)
 
+/* The maximum number of events returned by one wait */
+#define PIC_EVENTS 16
 
 
-static int pic_select(pic_selector* ps)
+static inline io_device* pic_device(uint id)
 {
-	/* select will sleep for about SLOW_HZ usec (half the system_clock res.) */
-	struct timeval sleeptime = { .tv_sec=0, .tv_usec = SERIAL_TIMEOUT };
-	int selcode = select(ps->maxfd, &ps->fds[IODIR_RX], &ps->fds[IODIR_TX], NULL, &sleeptime);
-
-	if(selcode == -1)  {
-		/* An error is likely EINTR */
-		if(errno != EINTR)  perror("PIC_loops: "); else perror("PIC_select:");
-	} else {
-		/* update system clock */
-		ps->system_clock = get_coarse_time();
-	}
-	return selcode;
+	return (id & 1) ? & TERM[id/2].con : & TERM[id/2].kbd;
 }
 
 
-static inline int pic_is_ready(pic_selector* ps, io_direction dir, int fd)
+static void pic_ctl(int op, int fd, uint32_t events, uint id)
 {
-	return FD_ISSET(fd, & ps->fds[dir]);
+	struct epoll_event ev = { .events = events | EPOLLET, .data.u32 = id };
+	CHECK(epoll_ctl(pic_epollfd, op, fd, &ev));
 }
 
 
-
-
-static inline void pic_add_io_device(pic_selector* ps, io_device* dev)
+static inline uint32_t pic_device_events(io_device* dev)
 {
-	if(! dev->ready) pic_add_fd(ps, dev->iodir, dev->fd);
+	return (dev->iodir == IODIR_RX) ? EPOLLIN : EPOLLOUT;
 }
 
 
-static inline void pic_add_terminal(pic_selector* ps, terminal* term)
+/* Re-arm the devices that were found not ready since the last call */
+static void pic_rearm_devices()
 {
-	/* First check that terminal is connected, without blocking.
-	   This is done by polling for errors on the kbd device. */
-	if(io_device_check(& term->kbd)) {
-		pic_add_io_device(ps, & term->kbd);
-		pic_add_io_device(ps, & term->con);
+	uint32_t mask = __atomic_exchange_n(& pic_rearm, 0, __ATOMIC_SEQ_CST);
+	while(mask) {
+		uint id = __builtin_ctz(mask);
+		mask &= mask-1;
+		io_device* dev = pic_device(id);
+		pic_ctl(EPOLL_CTL_MOD, dev->fd, pic_device_events(dev), id);
 	}
 }
 
 
-static void term_dev_raise_if_ready(io_device* dev, pic_selector* ps)
+/*
+	A device may have become ready. An error (e.g., a console with
+	no reader) does not count, the device waits for a new edge.
+ */
+static void pic_device_event(io_device* dev, uint32_t events)
 {
-	if(    pic_is_ready(ps, dev->iodir, dev->fd) 
-		|| (ps->system_clock - dev->last_int) > SERIAL_TIMEOUT 
-		)
-	{
-		dev->ready = 1;
-		dev->last_int = ps->system_clock;
-		Core* core = (Core*) dev->int_core;
-		switch(dev->iodir) {
-			case IODIR_RX:
-				raise_interrupt(core, SERIAL_RX_READY); break;
-			case IODIR_TX:
-				raise_interrupt(core, SERIAL_TX_READY); break;
-		}
+	if(dev->ready || (events & EPOLLERR) || !(events & pic_device_events(dev)))
+		return;
+
+	dev->ready = 1;
+	Core* core = (Core*) dev->int_core;
+
+	/* Tell the handler which device it is, before raising the interrupt */
+	__atomic_fetch_or(& core->serial_pending, 1u << dev->id, __ATOMIC_ACQ_REL);
+	switch(dev->iodir) {
+		case IODIR_RX:
+			raise_interrupt(core, SERIAL_RX_READY); break;
+		case IODIR_TX:
+			raise_interrupt(core, SERIAL_TX_READY); break;
 	}
 }
 
@@ -722,13 +781,23 @@ static void PIC_daemon(void)
 	CHECKRC(pthread_getname_np(pthread_self(), oldname, 16));
 	CHECKRC(pthread_setname_np(pthread_self(), "tinyos_vm"));
 
-	/* Open signal queues */
+	/* Open signal queue */
 	int sigusr1fd = open_signalfd(&sigusr1_set);
-	int sigalrmfd = open_signalfd(&sigalrm_set);
 
 	/* Set signal mask to block the signals monitored by signalfd */
 	sigset_t saved_mask;
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &signalfd_set, &saved_mask));
+
+	/* Create the epoll set. A device that is ready now reports an event. */
+	pic_epollfd = epoll_create1(EPOLL_CLOEXEC);
+	CHECK(pic_epollfd);
+	pic_rearm = 0;
+
+	pic_ctl(EPOLL_CTL_ADD, sigusr1fd, EPOLLIN, PIC_SIGUSR1_ID);
+	for(uint id=0; id<2*nterm; id++) {
+		io_device* dev = pic_device(id);
+		pic_ctl(EPOLL_CTL_ADD, dev->fd, pic_device_events(dev), id);
+	}
 		
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
@@ -736,53 +805,36 @@ static void PIC_daemon(void)
 	/* The PIC multiplexing loop */
 	while(PIC_active) {
 
-		pic_selector ps;
-
-		pic_selector_reset(&ps);
-
-		for(uint i=0; i<nterm; i++)
-			pic_add_terminal(&ps, & TERM[i]);
-
-		pic_add_fd(&ps, IODIR_RX, sigalrmfd);
-		pic_add_fd(&ps, IODIR_RX, sigusr1fd);
+		struct epoll_event events[PIC_EVENTS];
 
-		if(pic_select(&ps) == -1)
+		int nevents = epoll_wait(pic_epollfd, events, PIC_EVENTS, -1);
+		if(nevents == -1) {
+			/* An error is likely EINTR */
+			if(errno != EINTR)  perror("PIC_loops: ");
 			continue;
+		}
 
 		PIC_loops++ ;
 
-		if( pic_is_ready(&ps, IODIR_RX, sigalrmfd)!=-1 ) {
-			struct signalfd_siginfo sfdinfo;
+		for(int k=0; k<nevents; k++) {
+			uint id = events[k].data.u32;
 
-			while(read_signalfd(sigalrmfd, &sfdinfo) != -1) {
-				Core* core = & CORE[sfdinfo.ssi_int];
-				raise_interrupt(core, ALARM);
+			if(id == PIC_SIGUSR1_ID) {
+				drain_signalfd(sigusr1fd);
+				pic_rearm_devices();
 			}
+			else
+				pic_device_event(pic_device(id), events[k].events);
 		}
-
-
-		if( pic_is_ready(&ps, IODIR_RX, sigusr1fd)!=-1 ) {
-			drain_signalfd(sigusr1fd);
-		}
-
-
-		for(uint i=0; i<nterm; i++) {
-			terminal* term = & TERM[i];			
-
-			term_dev_raise_if_ready(& term->con, &ps);
-			term_dev_raise_if_ready(& term->kbd, &ps);
-		}
-
-
 	}
 
 
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
 
-	/* Close signal fds */
+	/* Close the epoll set and the signal fd */
+	CHECK(close(pic_epollfd));
 	close_signalfd(sigusr1fd);
-	close_signalfd(sigalrmfd);
 
 	/* Restore sigmask */
 	CHECKRC(pthread_sigmask(SIG_SETMASK, &saved_mask, NULL));
@@ -996,11 +1048,13 @@ uint cpu_cores()
 
 void cpu_core_halt()
 {
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
-
 	Core* core = curr_core();
 	uint32_t cmask = 1 << cpu_core_id;
 
+	core->intr_disabled = 1;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
+
 #if defined(CORE_STATISTICS)
 	TimerDuration stime0 = get_coarse_time();
 #endif
@@ -1012,19 +1066,19 @@ void cpu_core_halt()
 	core->hlt_count ++;
 #endif
 
-	siginfo_t info;
-
-	/* Sleep for 10 msec */
-	//struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
-	//int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
-	int rc = sigwaitinfo(&sigusr1_set, &info);
-
-	if(rc>0) {
-		/* Got signal, dispatch */
-		dispatch_interrupts(core);
-	}
-	else {
-		assert(rc==-1 &&  (errno == EINTR || errno == EAGAIN));
+	/* 
+		Do not sleep if an interrupt is already pending; its signal
+		may have been consumed while interrupts were disabled.
+	 */
+	if(core->intr_pending == 0) {
+		siginfo_t info;
+
+		/* Sleep for 10 msec */
+		//struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
+		//int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
+		int rc = sigwaitinfo(&sigusr1_set, &info);
+		assert(rc>0 || (rc==-1 &&  (errno == EINTR || errno == EAGAIN)));
+		if(rc>0) timer_signal(core, &info);
 	}
 
 #if defined(CORE_STATISTICS)
@@ -1035,6 +1089,9 @@ void cpu_core_halt()
 	__atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
 
 	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+
+	/* Dispatch what woke us up */
+	cpu_enable_interrupts();
 }
 
 static int __core_restart(uint c)
@@ -1092,32 +1149,138 @@ void cpu_ici(uint core)
 
 void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, &curss));
+	int enabled = cpu_disable_interrupts();
 	curr_core()->intvec[interrupt] = handler;
-	CHECKRC(pthread_sigmask(SIG_SETMASK, &curss, NULL));
+	if(enabled) cpu_enable_interrupts();
 }
 
+/*
+	The interrupt flag is only accessed by its own core thread, but a
+	signal handler may run (and even switch context) at any point.
+	The signal fences keep the compiler from caching curr_core() or the
+	flag across such points.
+ */
+
 int cpu_interrupts_enabled()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, NULL, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	return ! curr_core()->intr_disabled;
 }
 
 int cpu_disable_interrupts()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	int enabled = ! curr_core()->intr_disabled;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	curr_core()->intr_disabled = 1;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	return enabled;
 }
 
 void cpu_enable_interrupts()
 {
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	Core* core = curr_core();
+	core->intr_disabled = 0;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+	/* Replay the interrupts that arrived while disabled */
+	while(core->intr_pending) {
+		core->intr_disabled = 1;
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		dispatch_interrupts(core);
+
+		/* A handler may have moved us to another core */
+		core = curr_core();
+		core->intr_disabled = 0;
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	}
+}
+
+
+#ifdef BIOS_FAST_CONTEXT
+
+/*
+	The fast context switch (x86-64, System V ABI).
+
+	A suspended context is just a stack pointer. At the top of the
+	suspended stack are (from low to high addresses): the MXCSR and x87
+	control words, r15, r14, r13, r12, rbx, rbp and the return address.
+	All other registers are caller-saved, so the compiler has already
+	saved them before calling bios_switch_stack.
+
+	A new context is set up so that the return address points to
+	bios_context_start, which calls the function in r12.
+ */
+void bios_switch_stack(void** oldsp, void* newsp);
+void bios_context_start();
+
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	".type bios_switch_stack, @function\n"
+	"bios_switch_stack:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size bios_switch_stack, .-bios_switch_stack\n"
+	"\n"
+	".p2align 4\n"
+	".type bios_context_start, @function\n"
+	"bios_context_start:\n"
+	"	callq *%r12\n"
+	"	ud2\n"
+	".size bios_context_start, .-bios_context_start\n"
+);
+
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* The top of the stack, 16-byte aligned */
+	uintptr_t top = ((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15;
+	uint64_t* sp = (uint64_t*) top - 8;
+
+	/* Start with the current floating point control words */
+	uint32_t mxcsr;
+	uint16_t fpucw;
+	__asm__ volatile ("stmxcsr %0" : "=m"(mxcsr));
+	__asm__ volatile ("fnstcw %0" : "=m"(fpucw));
+
+	sp[0] = mxcsr | ((uint64_t)fpucw << 32);
+	sp[1] = 0;						/* r15 */
+	sp[2] = 0;						/* r14 */
+	sp[3] = 0;						/* r13 */
+	sp[4] = (uintptr_t) ctx_func;	/* r12 */
+	sp[5] = 0;						/* rbx */
+	sp[6] = 0;						/* rbp */
+	sp[7] = (uintptr_t) bios_context_start;	/* return address */
+
+	ctx->sp = sp;
 }
 
 
+void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
+{
+	bios_switch_stack(&oldctx->sp, newctx->sp);
+}
+
+#else
+
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
   /* Init the context from this context! */
@@ -1129,8 +1292,8 @@ void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, voi
   ctx->uc_stack.ss_size = ss_size;
   ctx->uc_stack.ss_flags = 0;
 
-  //CHECKRC(pthread_sigmask(0, NULL, & ctx->uc_sigmask));  /* We don't want any signals changed */
-  sigfillset( & ctx->uc_sigmask );
+  /* Interrupts are masked by the core's flag, so SIGUSR1 must stay unblocked */
+  ctx->uc_sigmask = core_signal_set;
   makecontext(ctx, (void*) ctx_func, 0);
 }
 
@@ -1140,6 +1303,8 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 	swapcontext(oldctx, newctx);
 }
 
+#endif
+
 
 
 /*
@@ -1203,13 +1368,47 @@ void bios_serial_interrupt_core(uint serial, Interrupt intno, uint coreid)
 }
 
 
+/*
+	Return and clear the serial ports that raised interrupt 'intno' on the
+	current core. Port i is bit i of the result.
+ */
+uint bios_serial_interrupts(Interrupt intno)
+{
+	if(!(intno==SERIAL_RX_READY || intno==SERIAL_TX_READY)) return 0;
+
+	/* The kbd of terminal i is device 2i, the con is 2i+1 */
+	uint shift = (intno==SERIAL_RX_READY) ? 0 : 1;
+	uint32_t mask = 0;
+	for(uint i=0; i<MAX_TERMINALS; i++)
+		mask |= 1u << (2*i + shift);
+
+	uint32_t devs = __atomic_fetch_and(& CORE[cpu_core_id].serial_pending, ~mask, 
+		__ATOMIC_ACQ_REL) & mask;
+
+	uint ports = 0;
+	for(uint i=0; i<MAX_TERMINALS; i++)
+		if(devs & (1u << (2*i + shift))) ports |= 1u << i;
+	return ports;
+}
+
+
 /*
 	Try to read a byte from serial port 'serial' and store it into the location
 	pointed by 'ptr'.  If the operation succeds, 1 is returned. If not, 0 is returned.
  */
 int bios_read_serial(uint serial, char* ptr)
 {
-	return io_device_read(& TERM[serial].kbd, ptr);
+	return bios_read_serial_block(serial, ptr, 1);
+}
+
+
+/*
+	Try to read up to 'size' bytes from serial port 'serial' into 'buf'.
+	Returns the number of bytes read, or 0 if none were available.
+ */
+uint bios_read_serial_block(uint serial, char* buf, uint size)
+{
+	return (size > 0) ? io_device_read(& TERM[serial].kbd, buf, size) : 0;
 }
 
 
@@ -1219,7 +1418,17 @@ int bios_read_serial(uint serial, char* ptr)
  */
 int bios_write_serial(uint serial, char value)
 {
-	return io_device_write(& TERM[serial].con, value);
+	return bios_write_serial_block(serial, &value, 1);
+}
+
+
+/*
+	Try to write up to 'size' bytes from 'buf' to serial port 'serial'.
+	Returns the number of bytes written, or 0 if the port was not ready.
+ */
+uint bios_write_serial_block(uint serial, const char* buf, uint size)
+{
+	return (size > 0) ? io_device_write(& TERM[serial].con, buf, size) : 0;
 }
 
 
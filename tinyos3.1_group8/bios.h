@@ -344,7 +344,9 @@ void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler);
 	If an interrupt arrives while interrupts are disabled, it will be
 	marked as _pending_ and will be raised when interrupts are re-enabled.
 
-	
+	Interrupts are disabled by a flag of the core, not by masking signals,
+	so this call and @ref cpu_enable_interrupts are cheap.
+
 
 	@returns 1 if interrupts were enabled before the call, else 0.
 	@see cpu_enable_interrupts
@@ -405,10 +407,28 @@ void cpu_core_restart_one();
 void cpu_core_restart_all();
 
 
+/**
+	@brief Use the hand-written context switch.
+
+	On x86-64, CPU contexts are switched by a few lines of assembly, which save only
+	the callee-saved registers and the stack pointer. Elsewhere, or when compiled with
+	@c -DBIOS_UCONTEXT, the portable @c ucontext(3) implementation is used instead.
+
+	Note that the fast context switch does not save or restore the signal mask; the
+	signal mask of the core thread is unaffected by a context switch.
+*/
+#if defined(__x86_64__) && !defined(BIOS_UCONTEXT)
+#define BIOS_FAST_CONTEXT
+#endif
+
 /**
 	@brief A type for saving CPU context into.
 */
+#ifdef BIOS_FAST_CONTEXT
+typedef struct { void* sp; } cpu_context_t;
+#else
 typedef ucontext_t cpu_context_t;
+#endif
 
 
 /**
@@ -512,6 +532,24 @@ uint bios_serial_ports();
 void bios_serial_interrupt_core(uint serial, Interrupt intno, uint core);
 
 
+/**
+	@brief Find the serial ports that raised an interrupt.
+
+	Return the set of serial ports that raised interrupt @c intno (one of 
+	@c SERIAL_RX_READY and @c SERIAL_TX_READY) on the current core, since 
+	the last call. Serial port @c i is bit @c i of the result. The set is 
+	cleared by the call, so it is meant to be called by the interrupt 
+	handler, which can then service only these ports. 
+
+	A port is added to the set before its interrupt is raised, so a result
+	of 0 means that an earlier call has already returned the ports.
+
+	@param intno the interrupt handled
+	@return a bitmask of serial ports
+ */
+uint bios_serial_interrupts(Interrupt intno);
+
+
 /**
 	@brief Read a byte from a serial port.
 
@@ -530,6 +568,23 @@ void bios_serial_interrupt_core(uint serial, Interrupt intno, uint core);
 int bios_read_serial(uint serial, char* ptr);
 
 
+/**
+	@brief Read a block of bytes from a serial port.
+
+	This is like @c bios_read_serial, but it transfers up to @c size bytes 
+	into @c buf, at the cost of one call. It returns the number of bytes 
+	transferred, which may be less than @c size. If it returns 0, a 
+	@c SERIAL_RX_READY interrupt will be raised when data is ready to be
+	received.
+
+	@param serial the serial device to read from
+	@param buf the location in which to store the bytes
+	@param size the maximum number of bytes to read
+	@return the number of bytes read
+ */
+uint bios_read_serial_block(uint serial, char* buf, uint size);
+
+
 /**
 	@brief Write a byte to a serial port.
 
@@ -546,4 +601,21 @@ int bios_read_serial(uint serial, char* ptr);
 int bios_write_serial(uint serial, char value);
 
 
+/**
+	@brief Write a block of bytes to a serial port.
+
+	This is like @c bios_write_serial, but it transfers up to @c size bytes
+	from @c buf, at the cost of one call. It returns the number of bytes 
+	transferred, which may be less than @c size. If it returns 0, a 
+	@c SERIAL_TX_READY interrupt will be raised when the device is ready 
+	to accept data.
+
+	@param serial the serial device to write to
+	@param buf the bytes to send
+	@param size the number of bytes to send
+	@return the number of bytes written
+ */
+uint bios_write_serial_block(uint serial, const char* buf, uint size);
+
+
 #endif
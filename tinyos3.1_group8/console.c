@@ -59,10 +59,7 @@ void tinyos_pseudo_console()
 		abort();
 	}
 
-	fcb[0]->streamobj = NULL;
-	fcb[1]->streamobj = NULL;
-
-	fcb[0]->streamfunc = &__stdio_ops;
-	fcb[1]->streamfunc = &__stdio_ops;
+	FCB_setup(fcb[0], NULL, &__stdio_ops);
+	FCB_setup(fcb[1], NULL, &__stdio_ops);
 
 }
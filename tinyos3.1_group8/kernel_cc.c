@@ -24,40 +24,211 @@
  	-------------------------
 
  	This mutex will act as a spinlock if preemption is off, and a
- 	yielding mutex if preemption is on.
+ 	parking mutex if preemption is on.
 
  	Therefore, we can call the same function from both the preemptive and
  	the non-preemptive domain of the kernel.
 
+ 	A mutex has three values: 0 (unlocked), 1 (locked) and 2 (locked, 
+ 	and there may be sleeping waiters). In the preemptive domain, a thread 
+ 	that does not get the mutex after spinning for a while goes to sleep 
+ 	in a wait bucket, selected by hashing the mutex address. 
+ 	Mutex_Unlock on a mutex with value 2 unlocks it and wakes up exactly
+ 	one of its waiters, which then competes for the mutex again.
+
+ 	The mutex is not handed over to the waiter while the waiter is asleep.
+ 	The same mutex may be locked as a spinlock in the non-preemptive domain, 
+ 	and spinning for a thread that is not running could deadlock a core.
+
+ 	The value of a mutex becomes 2 only under the lock of its bucket.
+ 	Spinlocks, which are only locked in the non-preemptive domain, never 
+ 	reach value 2, so they never touch the buckets.
+
  	The implementation is based on GCC atomics, as the standard C11 primitives
  	are not supported by all recent compilers. Eventually, this will change.
  */
-void Mutex_Lock(Mutex* lock)
+
+/** \cond HELPER Helper structures for sleeping on a mutex. */
+typedef struct __mutex_waiter {
+	rlnode node;				/* become part of a bucket ring */
+	Mutex* mutex;				/* the mutex waited for */
+	TCB* thread;				/* thread to wait */
+	int woken;					/* this is set when the waiter is removed from the ring */
+} __mutex_waiter;
+
+typedef struct __mutex_bucket {
+	Mutex lock;					/* spinlock protecting the bucket */
+	__mutex_waiter* waitset;	/* the ring of waiters, or NULL */
+} __mutex_bucket;
+/** \endcond */
+
+#define MUTEX_BUCKETS 64
+
+static __mutex_bucket mutex_buckets[MUTEX_BUCKETS];
+
+static inline __mutex_bucket* mutex_bucket(Mutex* mx)
 {
-#define MUTEX_SPINS (cpu_cores()>1 ?  1000 : 10000)
+	uintptr_t h = (uintptr_t) mx;
+	h ^= h >> 7;
+	h ^= h >> 13;
+	return & mutex_buckets[h % MUTEX_BUCKETS];
+}
+
+static inline int mutex_cas(Mutex* lock, Mutex old, Mutex new)
+{
+	return __atomic_compare_exchange_n(lock, &old, new, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline int mutex_cas_release(Mutex* lock, Mutex old, Mutex new)
+{
+	return __atomic_compare_exchange_n(lock, &old, new, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
 
-  while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
-    int spin=MUTEX_SPINS;
-    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+static inline void cpu_relax()
+{
 #if defined(__x86__) || defined(__x86_64__)
-      __builtin_ia32_pause();
+	__builtin_ia32_pause();
 #endif
-      if(spin>0) 
-      	spin--; 
-      else { 
-      	spin=MUTEX_SPINS; 
-      	if(cpu_interrupts_enabled())
-      		yield(SCHED_MUTEX); 
-      }
-    }
+}
+
+/* 
+	Return the first waiter for a mutex in a bucket, or NULL. Also, 
+	set *others if there are more waiters for the same mutex.
+	This is called with the bucket locked.
+ */
+static __mutex_waiter* mutex_first_waiter(__mutex_bucket* bucket, Mutex* lock, int* others)
+{
+	__mutex_waiter* first = NULL;
+	*others = 0;
+
+	if(bucket->waitset) {
+		__mutex_waiter* w = bucket->waitset;
+		do {
+			if(w->mutex == lock) {
+				if(first != NULL) { *others = 1; break; }
+				first = w;
+			}
+			w = w->node.next->obj;
+		} while(w != bucket->waitset);
+	}
+	return first;
+}
+
+/*
+	Wait until we get the mutex, sleeping in its bucket.
+	This is called with preemption on.
+ */
+static void mutex_park(Mutex* lock)
+{
+	__mutex_bucket* bucket = mutex_bucket(lock);
+	__mutex_waiter waiter = { .mutex = lock, .thread = cur_thread(), .woken = 0 };
+
+	preempt_off;
+	Mutex_Lock(& bucket->lock);
+
+	while(1) {
+		Mutex val = __atomic_load_n(lock, __ATOMIC_RELAXED);
+
+		if(val == 0) {
+			/* Keep value 2 if other threads are still sleeping */
+			int others;
+			Mutex new = mutex_first_waiter(bucket, lock, &others) ? 2 : 1;
+			if(mutex_cas(lock, 0, new)) break;
+			continue;
+		}
+		if(val == 1 && ! mutex_cas(lock, 1, 2))
+			continue;
+
+		/* The mutex has value 2, go to sleep */
+		rlnode_init(& waiter.node, &waiter);
+		waiter.woken = 0;
+		if(bucket->waitset)
+			rlist_push_back(& bucket->waitset->node, & waiter.node);
+		else
+			bucket->waitset = &waiter;
+
+		do {
+			sleep_releasing(STOPPED, & bucket->lock, SCHED_MUTEX, NO_TIMEOUT);
+			Mutex_Lock(& bucket->lock);
+		} while(! waiter.woken);
+	}
+
+	Mutex_Unlock(& bucket->lock);
+	preempt_on;
+}
+
+
+/*
+	Unlock a mutex with value 2, and wake up one of its waiters.
+ */
+static void mutex_unpark(Mutex* lock)
+{
+	__mutex_bucket* bucket = mutex_bucket(lock);
+
+	int preempt = preempt_off;
+	Mutex_Lock(& bucket->lock);
+
+	int others;
+	__mutex_waiter* w = mutex_first_waiter(bucket, lock, &others);
+
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+
+	if(w) {
+		/* Remove the waiter from the ring */
+		if(bucket->waitset == w) {
+			__mutex_waiter* nextw = w->node.next->obj;
+			bucket->waitset = (nextw == w) ? NULL : nextw;
+		}
+		rlist_remove(& w->node);
+		w->woken = 1;
+		wakeup(w->thread);
+	}
+
+	Mutex_Unlock(& bucket->lock);
+	if(preempt) preempt_on;
+}
+
+
+void Mutex_Lock(Mutex* lock)
+{
+#define MUTEX_SPINS (cpu_cores()>1 ?  1000 : 0)
+
+  /* Fast path */
+  if(mutex_cas(lock, 0, 1)) return;
+
+  /* In the non-preemptive domain, this is a spinlock */
+  if(! cpu_interrupts_enabled()) {
+    do {
+      while(__atomic_load_n(lock, __ATOMIC_RELAXED))
+        cpu_relax();
+    } while(! mutex_cas(lock, 0, 1));
+    return;
+  }
+
+  /* Spin for a while, in case the holder is about to unlock */
+  for(int spin=MUTEX_SPINS; spin>0; spin--) {
+    if(__atomic_load_n(lock, __ATOMIC_RELAXED)==0 && mutex_cas(lock, 0, 1))
+      return;
+    cpu_relax();
   }
+
+  mutex_park(lock);
 #undef MUTEX_SPINS
 }
 
 
 void Mutex_Unlock(Mutex* lock)
 {
-  __atomic_clear(lock, __ATOMIC_RELEASE);
+  /* Fast path: there are no waiters */
+  if(mutex_cas_release(lock, 1, 0)) return;
+
+  mutex_unpark(lock);
+}
+
+
+int Mutex_TryLock(Mutex* lock)
+{
+  return mutex_cas(lock, 0, 1);
 }
 
 
@@ -207,65 +378,14 @@ void Cond_Broadcast(CondVar* cv)
 
 /*
  *
- * The kernel locks
+ * Kernel condition variables
  *
  */
 
-/**
- * @brief The kernel lock.
- *
- * Kernel locking is provided by a semaphore, implemented as a monitor.
- * A semaphre for kernel locking has advantages over a simple mutex. 
- * The main advantage is that @c kernel_mutex is held for a very short time
- * regardless of contention. Thus, in multicore machines, it allows for cores
- * to be passed to other threads. 
- * 
- */
-
-/* This mutex is used to implement the kernel semaphore as a monitor. */
-static Mutex kernel_mutex = MUTEX_INIT;
-
-/* Semaphore counter */
-static int kernel_sem = 1;
-
-/* Semaphore condition */
-static CondVar kernel_sem_cv = COND_INIT;
-
-void kernel_lock()
-{
-	Mutex_Lock(& kernel_mutex);
-	while(kernel_sem<=0) {
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	}
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);
-}
-
-void kernel_unlock()
-{
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	Mutex_Unlock(& kernel_mutex);
-}
-
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan_name, TimerDuration timeout)
 {
-	/* Atomically release kernel semaphore */
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);	
-
-	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
-
-	/* Reacquire kernel semaphore */
-	while(kernel_sem<=0)
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);		
-
-	return ret;
+	return cv_wait(mx, cv, cause, timeout);
 }
 
 void kernel_signal(CondVar* cv) 
@@ -278,14 +398,7 @@ void kernel_broadcast(CondVar* cv)
 	Cond_Broadcast(cv); 
 }
 
-void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
+void kernel_sleep(Mutex* mx, Thread_state newstate, enum SCHED_CAUSE cause)
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
+	sleep_releasing(newstate, mx, cause, NO_TIMEOUT);
 }
-
-
-
-
@@ -31,38 +31,60 @@
 
 
 
+/**
+	@brief Try to lock a mutex, without waiting.
 
-/*
- * Kernel preemption control.
- * These are wrappers for the kernel monitor.
- */
+	This is used by the scheduler to break lock-order cycles, where
+	a thread holding one spinlock must not wait for another.
 
-/**
-	@brief Lock the kernel.
+	@returns 1 if the mutex was locked by this call, 0 if it was already locked.
  */
-void kernel_lock();
+int Mutex_TryLock(Mutex* lock);
 
-/**
-	@brief Unlock the kernel.
+
+
+/*
+ * Kernel locking.
+ *
+ * There is no big kernel lock. Each kernel object is protected by
+ * its own mutex, and system calls lock only the objects they touch:
+ *
+ * - @c proc_lock (kernel_proc.h) protects the process table, the
+ *   process tree and the PTCBs of every process.
+ * - The files lock (kernel_streams.c) protects the FCB freelist,
+ *   the FCB reference counts and the fileid tables.
+ * - @c port_map_lock (kernel_socket.c) protects @c PORT_MAP and the
+ *   rings of listeners that share a port.
+ * - Each socket_cb, PIPE_CB and serial device has its own lock.
+ * - The caches of free pipes and sockets have their own locks, under
+ *   which no other lock is taken.
+ *
+ * When more than one lock is held, they are taken in the order
+ *
+ *     proc_lock -> port_map_lock -> socket -> pipe, files lock
+ *
+ * A stream's @c Close method is never called with the files lock held.
  */
-void kernel_unlock();
 
 /**
-	@brief Wait on a condition variable using the kernel lock.
+	@brief Wait on a kernel condition variable.
+
+	This is @c Cond_Wait for kernel code. The mutex @c mx must be 
+	locked by the caller; it is released while the thread sleeps
+	and locked again before returning.
+
 	@returns 1 if signalled, 0 if not
   */
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan, TimerDuration timeout);
 
-#define kernel_wait(cv, cause) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, NO_TIMEOUT)
-#define kernel_timedwait(cv, cause, timeout) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
+#define kernel_wait(mx, cv, cause) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, NO_TIMEOUT)
+#define kernel_timedwait(mx, cv, cause, timeout) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, (timeout))
 
 /**
 	@brief Signal a kernel condition to one waiter.
-
-	This call must be made 
   */
 void kernel_signal(CondVar* cv);
 
@@ -73,12 +95,13 @@ void kernel_broadcast(CondVar* cv);
 
 
 /**
-	@brief Put thread to sleep, unlocking the kernel.
+	@brief Put thread to sleep, unlocking a kernel mutex.
 
-	System calls should call this function instead of @c sleep_releasing,
-	as the kernel lock is not a mutex.
+	The mutex @c mx is released only after the thread's state
+	has changed, so that no wakeup can be lost. It is not locked
+	again when the thread resumes.
   */
-void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
+void kernel_sleep(Mutex* mx, Thread_state state, enum SCHED_CAUSE cause);
 
 
 
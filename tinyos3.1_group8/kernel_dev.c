@@ -66,15 +66,38 @@ static file_ops nulldev_fops = {
 void serial_rx_handler();
 void serial_tx_handler();
 
+/* Size of the transmit queue of each terminal */
+#define SERIAL_TX_QUEUE 4096
+
+/* How long (in usec) the queues may take to drain at shutdown */
+#define SERIAL_CLOSING_WAIT 2000000
+
 typedef struct serial_device_control_block {
   uint devno;
   Mutex spinlock;
   CondVar rx_ready;
+  int rx_char;          /* A character read ahead by serial_poll, or -1 */
+  rlnode pollers;       /* Notified with rx_ready and tx_ready */
+
+  CondVar tx_ready;     /* Signalled when the transmit queue drains */
+  unsigned long tx_in;  /* Bytes ever put in the transmit queue */
+  unsigned long tx_out; /* Bytes ever sent to the device */
+  char tx_queue[SERIAL_TX_QUEUE];
 } serial_dcb_t;
 
 serial_dcb_t serial_dcb[MAX_TERMINALS];
 
 
+/*
+  The stream object of an open terminal. The dcb is shared by all
+  the streams of a terminal, the flags belong to each stream.
+ */
+typedef struct serial_stream {
+  serial_dcb_t* dcb;
+  int flags;            /* Stream flags, under the dcb spinlock */
+} serial_stream_t;
+
+
 
 /*
   Interrupt-driven driver for serial-device reads.
@@ -84,86 +107,216 @@ void serial_rx_handler()
 {
   int pre = preempt_off;
 
-  /* 
-    We do not know which terminal is
-    ready, so we must signal them all !
-   */
+  /* Signal only the terminals that are ready */
+  uint ports = bios_serial_interrupts(SERIAL_RX_READY);
   for(int i=0;i<bios_serial_ports();i++) {
+    if(! (ports & (1u<<i))) continue;
     serial_dcb_t* dcb = &serial_dcb[i];
+    Mutex_Lock(&dcb->spinlock);
     Cond_Broadcast(&dcb->rx_ready);
+    Mutex_Unlock(&dcb->spinlock);
+    poll_notify(&dcb->pollers, EV_READ);
   }
   if(pre) preempt_on;
 }
 
 /*
-  Read from the device, sleeping if needed.
+  Read from the device, sleeping if needed (unless the stream is non-blocking).
  */
 int serial_read(void* dev, char *buf, unsigned int size)
 {
-  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+  serial_stream_t* ss = (serial_stream_t*)dev;
+  serial_dcb_t* dcb = ss->dcb;
 
   preempt_off;            /* Stop preemption */
 
+  /* 
+    The spinlock is held while we check the device, so that 
+    the rx handler cannot signal before we wait.
+   */
+  Mutex_Lock(&dcb->spinlock);
+
   uint count =  0;
+  int nonblock = ss->flags & FLAG_NONBLOCK;
 
   while(count<size) {
-    int valid = bios_read_serial(dcb->devno, &buf[count]);
+    uint n;
+    if(dcb->rx_char >= 0) {
+      buf[count] = (char) dcb->rx_char;
+      dcb->rx_char = -1;
+      n = 1;
+    }
+    else
+      n = bios_read_serial_block(dcb->devno, &buf[count], size-count);
     
-    if (valid) {
-      count++;
+    if (n > 0) {
+      count += n;
     }
-    else if(count==0) {
-      kernel_wait(&dcb->rx_ready, SCHED_IO);
+    else if(count==0 && !nonblock) {
+      kernel_wait(&dcb->spinlock, &dcb->rx_ready, SCHED_IO);
     }
     else
       break;
   }
 
+  Mutex_Unlock(&dcb->spinlock);
+
   preempt_on;           /* Restart preemption */
 
-  return count;
+  return (count==0 && size>0) ? WOULDBLOCK : (int) count;
 }
 
 
 /*
-  A polling driver for serial writes
-  */
+  Interrupt-driven driver for serial-device writes.
+
+  Writers put their data in the transmit queue of the terminal and
+  sleep until it has been sent. The queue is moved to the device by
+  the writers and by the tx handler, as much as the device accepts.
+  When the device refuses data, it will raise SERIAL_TX_READY later.
+ */
+
+/* Send as much of the queue as the device accepts. Return the bytes sent.
+   Call with the spinlock held. */
+static unsigned int serial_tx_drain(serial_dcb_t* dcb)
+{
+  unsigned int sent = 0;
+  while(dcb->tx_out < dcb->tx_in) {
+    unsigned int pos = dcb->tx_out % SERIAL_TX_QUEUE;
+    unsigned int len = dcb->tx_in - dcb->tx_out;
+    if(len > SERIAL_TX_QUEUE - pos) len = SERIAL_TX_QUEUE - pos;
+
+    uint n = bios_write_serial_block(dcb->devno, dcb->tx_queue + pos, len);
+    if(n == 0) break;
+    dcb->tx_out += n;
+    sent += n;
+  }
+  return sent;
+}
 
-/* Interrupt driver */
 void serial_tx_handler()
 {
-  /* There is nothing to do */
+  int pre = preempt_off;
+
+  /* As with rx, drain only the terminals that are ready */
+  uint ports = bios_serial_interrupts(SERIAL_TX_READY);
+  for(int i=0;i<bios_serial_ports();i++) {
+    if(! (ports & (1u<<i))) continue;
+    serial_dcb_t* dcb = &serial_dcb[i];
+    Mutex_Lock(&dcb->spinlock);
+    int sent = serial_tx_drain(dcb) > 0;
+    if(sent) 
+      Cond_Broadcast(&dcb->tx_ready);
+    Mutex_Unlock(&dcb->spinlock);
+    if(sent)
+      poll_notify(&dcb->pollers, EV_WRITE);
+  }
+  if(pre) preempt_on;
+}
+
+/* Put as much of buf in the queue as fits. Return the bytes queued.
+   Call with the spinlock held. */
+static unsigned int serial_tx_queue(serial_dcb_t* dcb, const char* buf, unsigned int size)
+{
+  unsigned int room = SERIAL_TX_QUEUE - (dcb->tx_in - dcb->tx_out);
+  if(room > size) room = size;
+  for(unsigned int i=0; i<room; i++)
+    dcb->tx_queue[(dcb->tx_in + i) % SERIAL_TX_QUEUE] = buf[i];
+  dcb->tx_in += room;
+  return room;
 }
 
 /* 
   Write call 
-  This is currently a polling driver.
+  Returns when all the data has been sent to the device. A non-blocking
+  stream only queues what fits, and returns without waiting; what is
+  left in the queue is sent by finalize_devices() at shutdown.
 */
 int serial_write(void* dev, const char* buf, unsigned int size)
 {
-  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+  serial_stream_t* ss = (serial_stream_t*)dev;
+  serial_dcb_t* dcb = ss->dcb;
+
+  preempt_off;
+  Mutex_Lock(&dcb->spinlock);
 
   unsigned int count = 0;
-  while(count < size) {
-    int success = bios_write_serial(dcb->devno, buf[count] );
-
-    if(success) {
-      count++;
-    } 
-    else if(count==0)
-    {
-      yield(SCHED_IO);
+  int ret;
+  if(ss->flags & FLAG_NONBLOCK) {
+    /* Make room, if the device takes it */
+    serial_tx_drain(dcb);
+    count = serial_tx_queue(dcb, buf, size);
+    serial_tx_drain(dcb);
+    ret = (count==0 && size>0) ? WOULDBLOCK : (int) count;
+  }
+  else {
+    while(count < size) {
+      count += serial_tx_queue(dcb, buf+count, size-count);
+      unsigned long mine = dcb->tx_in;
+
+      /* Wait until our data is sent */
+      serial_tx_drain(dcb);
+      while(dcb->tx_out < mine)
+        kernel_wait(&dcb->spinlock, &dcb->tx_ready, SCHED_IO);
     }
-    else
-      break;
+    ret = count;
   }
 
-  return count;  
+  Mutex_Unlock(&dcb->spinlock);
+  preempt_on;
+
+  return ret;
+}
+
+
+/*
+  The device cannot be checked for input without reading it, 
+  so a character is read ahead, for serial_read to return.
+ */
+int serial_poll(void* dev, poll_table* pt)
+{
+  serial_dcb_t* dcb = ((serial_stream_t*)dev)->dcb;
+
+  poll_register(pt, &dcb->pollers);
+
+  int pre = preempt_off;
+  Mutex_Lock(&dcb->spinlock);
+  if(dcb->rx_char < 0) {
+    char c;
+    if(bios_read_serial(dcb->devno, &c))
+      dcb->rx_char = (unsigned char) c;
+  }
+  int ready = (dcb->rx_char >= 0);
+  int room = (dcb->tx_in - dcb->tx_out) < SERIAL_TX_QUEUE;
+  Mutex_Unlock(&dcb->spinlock);
+  if(pre) preempt_on;
+
+  return (ready ? EV_READ : 0) | (room ? EV_WRITE : 0);
+}
+
+
+/*
+  The flags are kept in the stream, under the spinlock, for the 
+  driver to check as it reads and writes.
+ */
+int serial_setflags(void* dev, int flags)
+{
+  serial_stream_t* ss = (serial_stream_t*)dev;
+  if(flags & ~FLAG_NONBLOCK)
+    return -1;
+
+  int pre = preempt_off;
+  Mutex_Lock(&ss->dcb->spinlock);
+  ss->flags = flags;
+  Mutex_Unlock(&ss->dcb->spinlock);
+  if(pre) preempt_on;
+  return 0;
 }
 
 
 int serial_close(void* dev) 
 {
+  free(dev);
   return 0;
 }
 
@@ -171,7 +324,10 @@ int serial_close(void* dev)
 void* serial_open(uint term)
 {
   assert(term<bios_serial_ports());
-  return & serial_dcb[term];  
+  serial_stream_t* ss = (serial_stream_t*) xmalloc(sizeof(serial_stream_t));
+  ss->dcb = & serial_dcb[term];
+  ss->flags = 0;
+  return ss;
 }
 
 
@@ -180,6 +336,8 @@ file_ops serial_fops = {
   .Open = serial_open,
   .Read = serial_read,
   .Write = serial_write,
+  .Poll = serial_poll,
+  .SetFlags = serial_setflags,
   .Close = serial_close
 };
 
@@ -211,6 +369,10 @@ void initialize_devices()
     serial_dcb[i].devno = i;
     serial_dcb[i].rx_ready = COND_INIT;
     serial_dcb[i].spinlock = MUTEX_INIT;
+    serial_dcb[i].rx_char = -1;
+    rlnode_new(&serial_dcb[i].pollers);
+    serial_dcb[i].tx_ready = COND_INIT;
+    serial_dcb[i].tx_in = serial_dcb[i].tx_out = 0;
   }
 
   cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
@@ -218,6 +380,30 @@ void initialize_devices()
 }
 
 
+/*
+  Send what non-blocking writes left in the transmit queues. The
+  scheduler has stopped, so we poll the devices, but a terminal that
+  does not take its data within SERIAL_CLOSING_WAIT loses the rest.
+ */
+void finalize_devices()
+{
+  TimerDuration deadline = bios_clock() + SERIAL_CLOSING_WAIT;
+
+  for(int i=0; i<bios_serial_ports(); i++) {
+    serial_dcb_t* dcb = &serial_dcb[i];
+    int pending = 1;
+    while(pending && bios_clock() < deadline) {
+      int pre = preempt_off;
+      Mutex_Lock(&dcb->spinlock);
+      serial_tx_drain(dcb);
+      pending = (dcb->tx_out < dcb->tx_in);
+      Mutex_Unlock(&dcb->spinlock);
+      if(pre) preempt_on;
+    }
+  }
+}
+
+
 int device_open(Device_type major, uint minor, void** obj, file_ops** ops)
 {
   assert(major < DEV_MAX);  
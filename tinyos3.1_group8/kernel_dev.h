@@ -9,6 +9,7 @@
 
 #include "util.h"
 #include "bios.h"
+#include "kernel_poll.h"
 
 /**
   @file kernel_dev.h
@@ -81,6 +82,53 @@ typedef struct file_operations {
   */
     int (*Write)(void* this, const char* buf, unsigned int size);
 
+  /** @brief Splice operation (optional).
+
+    Move up to 'size' bytes from the stream 'this' to the stream 'out',
+    by calling 'write' on 'out' directly with the stream's own buffers, 
+    instead of copying them through a user buffer. 
+    The Splice function blocks like Read, and returns the number of 
+    bytes moved, or -1 on error.
+
+    If this is NULL, the @c Splice system call moves data with Read 
+    and Write, through a bounce buffer.
+  */
+    int (*Splice)(void* this, int (*write)(void*, const char*, unsigned int), 
+                  void* out, unsigned int size);
+
+  /** @brief Vectored read operation (optional).
+
+    Like Read, but into the 'iovcnt' buffers of 'iov', in order.
+    If this is NULL, the @c ReadV system call calls Read for each buffer.
+  */
+    int (*ReadV)(void* this, const iovec_t* iov, unsigned int iovcnt);
+
+  /** @brief Vectored write operation (optional).
+
+    Like Write, but from the 'iovcnt' buffers of 'iov', in order.
+    If this is NULL, the @c WriteV system call calls Write for each buffer.
+  */
+    int (*WriteV)(void* this, const iovec_t* iov, unsigned int iovcnt);
+
+  /** @brief Poll operation (optional).
+
+    Return the readiness of the stream, as a combination of @c EV_READ, 
+    @c EV_WRITE and @c EV_HUP. If 'pt' is not NULL, first register it 
+    (by @c poll_register) on the queues that are notified when this 
+    changes, at most @c POLL_QUEUES_PER_STREAM of them.
+    If this is NULL, the stream is always ready for the operations it has.
+  */
+    int (*Poll)(void* this, poll_table* pt);
+
+  /** @brief Flags operation (optional).
+
+    Called by @c SetFlags with the new flags of the stream, before they 
+    are set. It returns 0 if the stream accepts them, or -1 if not.
+    Calls are serialized, so the old flags can be read from the FCB.
+    If this is NULL, the stream accepts only @c FLAG_NONBLOCK.
+  */
+    int (*SetFlags)(void* this, int flags);
+
     /** @brief Close operation.
 
       Close the stream object, deallocating any resources held by it.
@@ -137,6 +185,15 @@ typedef struct device_control_block
 void initialize_devices();
 
 
+/** 
+  @brief Finalization for devices.
+
+  This function is called after the scheduler has stopped on all cores,
+  to send the data still queued for the terminals.
+ */
+void finalize_devices();
+
+
 /**
   @brief Open a device.
 
@@ -10,6 +10,10 @@ static file_ops pipe_read_file_ops = {
 	.Open = NULL,
 	.Read = pipe_read,
 	.Write = NULL,
+	.Splice = pipe_splice,
+	.ReadV = pipe_readv,
+	.Poll = pipe_reader_poll,
+	.SetFlags = pipe_reader_setflags,
 	.Close = pipe_reader_close};
 
 // File operations for pipe write
@@ -17,10 +21,122 @@ static file_ops pipe_write_file_ops = {
 	.Open = NULL,
 	.Read = NULL,
 	.Write = pipe_write,
+	.WriteV = pipe_writev,
+	.Poll = pipe_writer_poll,
+	.SetFlags = pipe_writer_setflags,
 	.Close = pipe_writer_close};
 
 
+/* Round a requested buffer size up to a power of two, within limits */
+static unsigned int pipe_buffer_size(unsigned int size)
+{
+	if (size == 0)
+		return PIPE_BUFFER_SIZE;
+
+	unsigned int s = PIPE_BUFFER_MIN;
+	while (s < size && s < PIPE_BUFFER_MAX)
+		s <<= 1;
+	return s;
+}
+
+/*
+	The pipe cache.
+
+	Freed pipes are kept for reuse, so that short-lived pipes and 
+	connections do not go through the allocator. A cached pipe keeps 
+	its ring, if the ring has the default size, and the next pipe 
+	of that size starts with it. At most PIPE_CACHE_MAX pipes are kept.
+ */
+
+/* Free pipes, linked by r_pollers */
+static rlnode pipe_cache = { .obj = NULL, .prev = &pipe_cache, .next = &pipe_cache };
+static unsigned int pipe_cache_count = 0; /* The length of pipe_cache */
+static Mutex pipe_cache_lock = MUTEX_INIT;
+
+/* Get a free pipe from the cache, or allocate a new one */
+static PIPE_CB* pipe_cache_get()
+{
+	PIPE_CB* pipe_cb = NULL;
+
+	Mutex_Lock(&pipe_cache_lock);
+	if (pipe_cache_count > 0) {
+		pipe_cb = rlist_pop_front(&pipe_cache)->obj;
+		pipe_cache_count--;
+	}
+	Mutex_Unlock(&pipe_cache_lock);
+
+	if (pipe_cb == NULL) {
+		pipe_cb = (PIPE_CB *)xmalloc(sizeof(PIPE_CB));
+		pipe_cb->buffer = NULL;
+	}
+	return pipe_cb;
+}
+
+/* Return a freed pipe to the cache, or to the allocator */
+static void pipe_cache_put(PIPE_CB* pipe_cb)
+{
+	if (pipe_cb->buffer != NULL && pipe_cb->size != PIPE_BUFFER_SIZE) {
+		free(pipe_cb->buffer);
+		pipe_cb->buffer = NULL;
+	}
+
+	Mutex_Lock(&pipe_cache_lock);
+	if (pipe_cache_count < PIPE_CACHE_MAX) {
+		pipe_cache_count++;
+		rlnode_init(&pipe_cb->r_pollers, pipe_cb);
+		rlist_push_front(&pipe_cache, &pipe_cb->r_pollers);
+		pipe_cb = NULL;
+	}
+	Mutex_Unlock(&pipe_cache_lock);
+
+	if (pipe_cb != NULL) {
+		free(pipe_cb->buffer);
+		free(pipe_cb);
+	}
+}
+
+/* The buffer of pipe_cb is NULL, or a ring of a pipe in the cache */
+static void initialize_PIPE_CB(PIPE_CB* pipe_cb, FCB* reader, FCB* writer, unsigned int size)
+{
+	pipe_cb->lock = MUTEX_INIT;
+	pipe_cb->reader = reader;
+	pipe_cb->writer = writer;
+
+	pipe_cb->has_space = COND_INIT;
+	pipe_cb->has_data = COND_INIT;
+
+	pipe_cb->r_waiting = 0;
+	pipe_cb->w_waiting = 0;
+	pipe_cb->read_lock = MUTEX_INIT;
+	pipe_cb->write_lock = MUTEX_INIT;
+
+	pipe_cb->w_position = 0;
+	pipe_cb->r_position = 0;
+
+	pipe_cb->r_buf = NULL;
+	pipe_cb->r_want = 0;
+	pipe_cb->r_got = 0;
+
+	// The buffer is allocated by the first write, unless it is cached
+	pipe_cb->base_size = pipe_buffer_size(size);
+	if (pipe_cb->buffer != NULL && pipe_cb->base_size != PIPE_BUFFER_SIZE) {
+		free(pipe_cb->buffer);
+		pipe_cb->buffer = NULL;
+	}
+	pipe_cb->size = pipe_cb->base_size;
+
+	pipe_cb->packet = 0;
+
+	rlnode_new(&pipe_cb->r_pollers);
+	rlnode_new(&pipe_cb->w_pollers);
+}
+
 int sys_Pipe(pipe_t* pipe)
+{
+	return sys_PipeWithSize(pipe, PIPE_BUFFER_SIZE);
+}
+
+int sys_PipeWithSize(pipe_t* pipe, unsigned int size)
 {
 	// Allocate two FCBs
 	Fid_t fid[2];
@@ -32,129 +148,668 @@ int sys_Pipe(pipe_t* pipe)
 		return -1;
 	}
 	// Allocate a PIPE_CB
-	PIPE_CB *pipe_cb = (PIPE_CB *)xmalloc(sizeof(PIPE_CB));
+	PIPE_CB *pipe_cb = pipe_cache_get();
 
 	// Initialize PIPE_CB
 	pipe->read = fid[0];
 	pipe->write = fid[1];
-	pipe_cb->reader = fcb[0];
-	pipe_cb->writer = fcb[1];
+	initialize_PIPE_CB(pipe_cb, fcb[0], fcb[1], size);
 
-	pipe_cb->has_space = COND_INIT;
-	pipe_cb->has_data = COND_INIT;
+	FCB_setup(fcb[0], pipe_cb, &pipe_read_file_ops);
+	FCB_setup(fcb[1], pipe_cb, &pipe_write_file_ops);
 
-	pipe_cb->w_position = 0;
-	pipe_cb->r_position = 0;
-	pipe_cb->current_size = 0;
+	return 0;
+}
 
-	fcb[0]->streamobj = pipe_cb;
-	fcb[1]->streamobj = pipe_cb;
-	fcb[0]->streamfunc = &pipe_read_file_ops;
-	fcb[1]->streamfunc = &pipe_write_file_ops;
+static void free_PIPE_CB(PIPE_CB* pipe_cb)
+{
+	poll_detach(&pipe_cb->r_pollers);
+	poll_detach(&pipe_cb->w_pollers);
+	pipe_cache_put(pipe_cb);
+}
 
-	return 0;
+/*
+	The ring buffer.
+
+	Each side reads the position of the other side with an acquire load, 
+	copies, and publishes its own position with a release store. 
+	Thus, the common case of a single reader and a single writer
+	takes no contended lock and issues no wakeups.
+
+	A side that finds the ring empty (or full) sets its waiting flag
+	and sleeps under pipe_cb->lock. After publishing its position, the
+	other side checks the flag, and only if set does it take the lock 
+	to wake it up. The seq_cst fences between storing the flag and
+	loading the position (and vice versa) make sure that at least one
+	of the two sides sees the other. The pollers of that side 
+	are notified in the same way.
+ */
+
+static inline void pipe_wake(PIPE_CB* pipe_cb, int* waiting, CondVar* cv, 
+	rlnode* pollers, int events)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiting, __ATOMIC_RELAXED)) {
+		Mutex_Lock(&pipe_cb->lock);
+		kernel_broadcast(cv);
+		Mutex_Unlock(&pipe_cb->lock);
+	}
+	poll_notify(pollers, events);
 }
 
-int pipe_read(void* pipecb_t, char *buf, unsigned int size) {
+/*
+	Replace the ring with an empty one of the given size, or free it 
+	if the size is 0. The ring must be empty and write_lock held.
+ */
+static void pipe_resize(PIPE_CB* pipe_cb, unsigned int size)
+{
+	free(pipe_cb->buffer);
+	pipe_cb->buffer = (size > 0) ? (char*) xmalloc(size) : NULL;
+	pipe_cb->size = (size > 0) ? size : pipe_cb->base_size;
+}
 
-	int i = 0;
-	int n = 0;
+/*
+	Sleep while the ring is empty. While asleep, the reader offers
+	its buffer of want bytes to the writer, which may copy data into
+	it directly (see pipe_handoff). If buf is NULL, nothing is offered.
 
-	PIPE_CB* pipe_cb = (PIPE_CB*) pipecb_t;
+	The ring is kept, with the size it has grown to, so that the next
+	burst of writes does not allocate. If the pipe stays empty for 
+	PIPE_IDLE_TIMEOUT, the ring is freed, and the next write allocates
+	one of base_size.
+
+	Returns the number of bytes copied into buf by the writer, or 
+	-1 if the writer has exited and there is no more data.
+ */
+static int pipe_wait_data(PIPE_CB* pipe_cb, unsigned int r, char* buf, unsigned int want)
+{
+	int ret;
+	int idle = 0;
+
+	Mutex_Lock(&pipe_cb->lock);
+	pipe_cb->r_buf = buf;
+	pipe_cb->r_want = want;
+	pipe_cb->r_got = 0;
+	__atomic_store_n(&pipe_cb->r_waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	while (__atomic_load_n(&pipe_cb->w_position, __ATOMIC_ACQUIRE) == r 
+		&& (buf == NULL || pipe_cb->r_got < want) && pipe_cb->writer != NULL) {
+		if (idle)
+			kernel_wait(&pipe_cb->lock, &pipe_cb->has_data, SCHED_PIPE);
+		else if (! kernel_timedwait(&pipe_cb->lock, &pipe_cb->has_data, SCHED_PIPE, PIPE_IDLE_TIMEOUT)) {
+			/* An idle pipe gives its ring back, unless a writer is using it */
+			idle = 1;
+			if (Mutex_TryLock(&pipe_cb->write_lock)) {
+				if (pipe_cb->buffer != NULL && __atomic_load_n(&pipe_cb->w_position, __ATOMIC_ACQUIRE) == r)
+					pipe_resize(pipe_cb, 0);
+				Mutex_Unlock(&pipe_cb->write_lock);
+			}
+		}
+	}
+
+	ret = pipe_cb->r_got;
+	if (ret == 0 && pipe_cb->writer == NULL 
+		&& __atomic_load_n(&pipe_cb->w_position, __ATOMIC_ACQUIRE) == r) 
+		ret = -1; // Writer exited & no more characters in buffer
+
+	pipe_cb->r_buf = NULL;
+	__atomic_store_n(&pipe_cb->r_waiting, 0, __ATOMIC_RELAXED);
+	Mutex_Unlock(&pipe_cb->lock);
+	return ret;
+}
+
+/*
+	The rendezvous fast path. If the ring is empty and the reader is
+	asleep in pipe_wait_data, copy data straight into its buffer, 
+	instead of through the ring. Since the ring is empty, the data
+	cannot overtake earlier data. The reader is woken up when its 
+	buffer is full; until then it may receive more from later writes.
+
+	Returns the number of bytes copied.
+ */
+static unsigned int pipe_handoff(PIPE_CB* pipe_cb, unsigned int w, const char* buf, unsigned int n)
+{
+	unsigned int done = 0;
+
+	Mutex_Lock(&pipe_cb->lock);
+	if (pipe_cb->r_buf != NULL && __atomic_load_n(&pipe_cb->r_position, __ATOMIC_ACQUIRE) == w) {
+		done = pipe_cb->r_want - pipe_cb->r_got;
+		if (done > n)
+			done = n;
+
+		memcpy(&pipe_cb->r_buf[pipe_cb->r_got], buf, done);
+		pipe_cb->r_got += done;
+
+		if (pipe_cb->r_got == pipe_cb->r_want)
+			kernel_broadcast(&pipe_cb->has_data);
+	}
+	Mutex_Unlock(&pipe_cb->lock);
+
+	return done;
+}
+
+/* Sleep while the ring holds more than limit bytes. Returns 0 if the reader has exited. */
+static int pipe_wait_space(PIPE_CB* pipe_cb, unsigned int w, unsigned int limit)
+{
+	int ret = 1;
+
+	Mutex_Lock(&pipe_cb->lock);
+	__atomic_store_n(&pipe_cb->w_waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	while (w - __atomic_load_n(&pipe_cb->r_position, __ATOMIC_ACQUIRE) > limit) {
+		if (pipe_cb->reader == NULL) { // Nobody will ever make space
+			ret = 0;
+			break;
+		}
+		kernel_wait(&pipe_cb->lock, &pipe_cb->has_space, SCHED_PIPE);
+	}
+	if (pipe_cb->reader == NULL)
+		ret = 0;
+
+	__atomic_store_n(&pipe_cb->w_waiting, 0, __ATOMIC_RELAXED);
+	Mutex_Unlock(&pipe_cb->lock);
+	return ret;
+}
+
+
+/* The total size of a vector of buffers */
+static unsigned int iov_size(const iovec_t* iov, unsigned int iovcnt)
+{
+	unsigned int size = 0;
+	for (unsigned int k = 0; k < iovcnt; k++)
+		size += iov[k].len;
+	return size;
+}
+
+/*
+	Take bytes out of the pipe. They are copied into the buffers of iov,
+	until they are full, or, if iov is NULL, up to size bytes are passed 
+	to write(out, ...) straight from the ring.
+
+	If the reader is non-blocking, stop when the ring is empty.
+ */
+static int packet_take(PIPE_CB* pipe_cb, const iovec_t* iov, unsigned int iovcnt,
+	int (*write)(void*, const char*, unsigned int), void* out, unsigned int size);
+
+static int pipe_take(PIPE_CB* pipe_cb, const iovec_t* iov, unsigned int iovcnt,
+	int (*write)(void*, const char*, unsigned int), void* out, unsigned int size)
+{
+	unsigned int i = 0;
+	unsigned int n;
+	int ret = 0;
+
+	unsigned int v = 0;     // The current buffer of iov
+	unsigned int vpos = 0;  // The position in iov[v]
 
 	if (pipe_cb->reader == NULL) // Reader has already exited
 		return -1;
-	else if (pipe_cb->writer == NULL && pipe_cb->current_size == 0) // Buffer is empty & writer has exited, can't read
-		return 0;
+
+	if (pipe_cb->packet)
+		return packet_take(pipe_cb, iov, iovcnt, write, out, size);
+
+	int nonblock = pipe_cb->reader->flags & FLAG_NONBLOCK;
+
+	if (iov != NULL)
+		size = iov_size(iov, iovcnt);
+
+	Mutex_Lock(&pipe_cb->read_lock);
+
+	unsigned int r = pipe_cb->r_position;
 
 	while (i < size) {
 
-		while (pipe_cb->current_size == 0 && pipe_cb->writer != NULL) {
-			kernel_broadcast(&pipe_cb->has_space);
-			kernel_wait(&pipe_cb->has_data, SCHED_PIPE);
+		// Where the data goes
+		char* dst = NULL;
+		unsigned int room = size - i;
+		if (iov != NULL) {
+			while (vpos == iov[v].len) { 
+				v++; 
+				vpos = 0; 
+			}
+			dst = (char*) iov[v].base + vpos;
+			room = iov[v].len - vpos;
 		}
 
-		if (pipe_cb->writer == NULL && pipe_cb->current_size == 0) // Writer exited & no more characters to write from buffer, exit
-			return i;
-
-		if ((n = (size - i)) < pipe_cb->current_size)
-			n = size - i;
-		else
-			n = pipe_cb->current_size;
+		unsigned int avail = __atomic_load_n(&pipe_cb->w_position, __ATOMIC_ACQUIRE) - r;
+
+		if (avail == 0 && nonblock) {
+			if (pipe_cb->writer != NULL) {
+				if (i == 0)
+					ret = WOULDBLOCK;
+				break;
+			}
+			// The writer has exited, but it may have written more first
+			if (__atomic_load_n(&pipe_cb->w_position, __ATOMIC_ACQUIRE) == r)
+				break;
+			continue;
+		}
 
-		if (n >= (PIPE_BUFFER_SIZE - pipe_cb->r_position))
-			n = PIPE_BUFFER_SIZE - pipe_cb->r_position;
+		if (avail == 0) {
+			int got = pipe_wait_data(pipe_cb, r, dst, room);
+			if (got < 0) // Writer exited, return what we have
+				break;
+			i += got;
+			vpos += got;
+			continue;
+		}
 
-		memcpy(&(buf[i]), &(pipe_cb->buffer[pipe_cb->r_position]),n);
+		// The ring cannot change while it holds data
+		unsigned int off = r & (pipe_cb->size - 1);
+
+		n = room;
+		if (n > avail)
+			n = avail;
+		if (n > pipe_cb->size - off)
+			n = pipe_cb->size - off;
+
+		if (dst != NULL)
+			memcpy(dst, &pipe_cb->buffer[off], n);
+		else {
+			// The data leaves the ring only after write returns
+			int w = write(out, &pipe_cb->buffer[off], n);
+			if (w < 0) {
+				ret = w;  // An error, or the output would block
+				break;
+			}
+			if (w < n)
+				ret = -1;  // The output was closed, stop after this
+			n = w;
+		}
 
-		pipe_cb->r_position = (pipe_cb->r_position + n) % PIPE_BUFFER_SIZE;
+		r += n;
+		i += n;
+		vpos += n;
+		__atomic_store_n(&pipe_cb->r_position, r, __ATOMIC_RELEASE);
 
-		pipe_cb->current_size = pipe_cb->current_size - n;
-		i = i + n;
+		pipe_wake(pipe_cb, &pipe_cb->w_waiting, &pipe_cb->has_space, &pipe_cb->w_pollers, EV_WRITE);
 
-		kernel_broadcast(&pipe_cb->has_space); // Signal empty space within loop, wait for write
+		if (ret < 0)
+			break;
 	}
 
-	kernel_broadcast(&pipe_cb->has_space);
+	Mutex_Unlock(&pipe_cb->read_lock);
+	return (i == 0 && ret < 0) ? ret : (int) i;
+}
 
-	return i;
+int pipe_read(void* pipecb_t, char *buf, unsigned int size) {
+	iovec_t iov = { .base = buf, .len = size };
+	return pipe_take((PIPE_CB*) pipecb_t, &iov, 1, NULL, NULL, 0);
 }
 
-int pipe_write(void* pipecb_t, const char *buf, unsigned int size) {
-	
-	int i = 0;
-	int n;
+int pipe_readv(void* pipecb_t, const iovec_t* iov, unsigned int iovcnt) {
+	return pipe_take((PIPE_CB*) pipecb_t, iov, iovcnt, NULL, NULL, 0);
+}
+
+int pipe_splice(void* pipecb_t, int (*write)(void*, const char*, unsigned int), 
+	void* out, unsigned int size) {
+	// Nobody could drain a pipe that is spliced into itself
+	if (write == pipe_write && out == pipecb_t)
+		return -1;
+	return pipe_take((PIPE_CB*) pipecb_t, NULL, 0, write, out, size);
+}
+
+
+/* Make the ring up to position w visible to the reader */
+static inline void pipe_publish(PIPE_CB* pipe_cb, unsigned int w)
+{
+	if (w != pipe_cb->w_position) {
+		__atomic_store_n(&pipe_cb->w_position, w, __ATOMIC_RELEASE);
+		pipe_wake(pipe_cb, &pipe_cb->r_waiting, &pipe_cb->has_data, &pipe_cb->r_pollers, EV_READ);
+	}
+}
+
+/*
+	Put the bytes of the buffers of iov into the pipe. The data is
+	published (and the reader woken up) once at the end, or before 
+	sleeping, or every half ring, so that the reader can work in parallel.
+
+	If the writer is non-blocking, stop when the ring is full.
+ */
+static int packet_put(PIPE_CB* pipe_cb, const iovec_t* iov, unsigned int iovcnt);
+
+static int pipe_put(PIPE_CB* pipe_cb, const iovec_t* iov, unsigned int iovcnt)
+{
+	unsigned int i = 0;
+	unsigned int n;
 
-	PIPE_CB* pipe_cb = (PIPE_CB*) pipecb_t;
+	unsigned int v = 0;     // The current buffer of iov
+	unsigned int vpos = 0;  // The position in iov[v]
 
 	if (pipe_cb->reader == NULL || pipe_cb->writer == NULL)
 		return -1;
 
+	if (pipe_cb->packet)
+		return packet_put(pipe_cb, iov, iovcnt);
+
+	int nonblock = pipe_cb->writer->flags & FLAG_NONBLOCK;
+	int blocked = 0;
+	unsigned int size = iov_size(iov, iovcnt);
+
+	Mutex_Lock(&pipe_cb->write_lock);
+
+	unsigned int w = pipe_cb->w_position;
+
 	while (i < size) {
 
-		while (pipe_cb->current_size == PIPE_BUFFER_SIZE && pipe_cb->reader) {
-			kernel_broadcast(&pipe_cb->has_data);
-			kernel_wait(&pipe_cb->has_space, SCHED_PIPE);
+		while (vpos == iov[v].len) { 
+			v++; 
+			vpos = 0; 
+		}
+		const char* src = (const char*) iov[v].base + vpos;
+		unsigned int left = iov[v].len - vpos;
+
+		unsigned int space = pipe_cb->size - (w - __atomic_load_n(&pipe_cb->r_position, __ATOMIC_ACQUIRE));
+
+		// A reader waits on the empty ring, give it the data directly
+		if (space == pipe_cb->size && __atomic_load_n(&pipe_cb->r_waiting, __ATOMIC_RELAXED)) {
+			n = pipe_handoff(pipe_cb, w, src, left);
+			if (n > 0) {
+				i += n;
+				vpos += n;
+				continue;
+			}
 		}
 
-		if (pipe_cb->reader == NULL || pipe_cb->writer == NULL)
-			return i;
-		
-		if ((n = (size - i)) < (PIPE_BUFFER_SIZE - pipe_cb->current_size))
-			n = size - i;
-		else
-			n = PIPE_BUFFER_SIZE - pipe_cb->current_size;
+		if (space == 0) {
+			pipe_publish(pipe_cb, w);
 
-		if (n >= (PIPE_BUFFER_SIZE - pipe_cb->w_position))
-			n = PIPE_BUFFER_SIZE - pipe_cb->w_position;
-		
-		memcpy(&(pipe_cb->buffer[pipe_cb->w_position]), &(buf[i]), n);
-		assert(pipe_cb->w_position < PIPE_BUFFER_SIZE); // Test
+			if (nonblock) {
+				blocked = 1;
+				break;
+			}
 
-		pipe_cb->w_position = (pipe_cb->w_position + n) % PIPE_BUFFER_SIZE;
+			// Under sustained load, wait for the ring to drain and double it
+			int grow = (pipe_cb->size < PIPE_BUFFER_MAX);
 
-		pipe_cb->current_size = pipe_cb->current_size + n;
-		i = i + n;
+			if (! pipe_wait_space(pipe_cb, w, grow ? 0 : pipe_cb->size - 1)) // Reader exited, return what we wrote
+				break;
+			if (grow)
+				pipe_resize(pipe_cb, 2 * pipe_cb->size);
+			continue;
+		}
+
+		// The ring is empty if it is not allocated
+		if (pipe_cb->buffer == NULL)
+			pipe_resize(pipe_cb, pipe_cb->base_size);
+
+		unsigned int off = w & (pipe_cb->size - 1);
+
+		n = left;
+		if (n > space)
+			n = space;
+		if (n > pipe_cb->size - off)
+			n = pipe_cb->size - off;
+
+		memcpy(&pipe_cb->buffer[off], src, n);
+
+		w += n;
+		i += n;
+		vpos += n;
+
+		if (w - pipe_cb->w_position >= pipe_cb->size / 2)
+			pipe_publish(pipe_cb, w);
 	}
 
-	kernel_broadcast(&pipe_cb->has_data);
+	pipe_publish(pipe_cb, w);
 
-	return i;
+	Mutex_Unlock(&pipe_cb->write_lock);
+	return (i == 0 && blocked) ? WOULDBLOCK : (int) i;
+}
+
+int pipe_write(void* pipecb_t, const char *buf, unsigned int size) {
+	iovec_t iov = { .base = (void*) buf, .len = size };
+	return pipe_put((PIPE_CB*) pipecb_t, &iov, 1);
+}
 
+int pipe_writev(void* pipecb_t, const iovec_t* iov, unsigned int iovcnt) {
+	return pipe_put((PIPE_CB*) pipecb_t, iov, iovcnt);
 }
+
+/*
+	Packet mode.
+
+	A record is copied into the ring and published at once, so the 
+	reader sees either all of it or nothing. The ring grows (while 
+	empty) to fit large records. There is no direct handoff, since
+	the reader must get exactly one record.
+ */
+
+/* Copy n bytes into the ring at position w, wrapping around */
+static void ring_put(PIPE_CB* pipe_cb, unsigned int w, const void* src, unsigned int n)
+{
+	unsigned int off = w & (pipe_cb->size - 1);
+	unsigned int n1 = (n < pipe_cb->size - off) ? n : pipe_cb->size - off;
+	memcpy(&pipe_cb->buffer[off], src, n1);
+	memcpy(pipe_cb->buffer, (const char*) src + n1, n - n1);
+}
+
+/* Copy n bytes out of the ring at position r, wrapping around */
+static void ring_get(PIPE_CB* pipe_cb, unsigned int r, void* dst, unsigned int n)
+{
+	unsigned int off = r & (pipe_cb->size - 1);
+	unsigned int n1 = (n < pipe_cb->size - off) ? n : pipe_cb->size - off;
+	memcpy(dst, &pipe_cb->buffer[off], n1);
+	memcpy((char*) dst + n1, pipe_cb->buffer, n - n1);
+}
+
+static int packet_put(PIPE_CB* pipe_cb, const iovec_t* iov, unsigned int iovcnt)
+{
+	unsigned int size = iov_size(iov, iovcnt);
+	unsigned int need = PIPE_RECORD_HEADER + size;
+
+	if (size == 0)  // It would read as end of data
+		return 0;
+	if (need > PIPE_BUFFER_MAX)
+		return -1;
+
+	int nonblock = pipe_cb->writer->flags & FLAG_NONBLOCK;
+	int ret = size;
+
+	Mutex_Lock(&pipe_cb->write_lock);
+
+	unsigned int w = pipe_cb->w_position;
+
+	for (;;) {
+		if (pipe_cb->reader == NULL) {
+			ret = -1;
+			break;
+		}
+
+		unsigned int used = w - __atomic_load_n(&pipe_cb->r_position, __ATOMIC_ACQUIRE);
+
+		if (used == 0 && (pipe_cb->buffer == NULL || pipe_cb->size < need)) {
+			unsigned int s = pipe_cb->base_size;
+			while (s < need)
+				s <<= 1;
+			pipe_resize(pipe_cb, s);
+		}
+
+		if (pipe_cb->size - used >= need)
+			break;
+
+		if (nonblock) {
+			ret = WOULDBLOCK;
+			break;
+		}
+
+		// Wait for room, or for the ring to drain, if it must grow
+		unsigned int limit = (pipe_cb->size >= need) ? pipe_cb->size - need : 0;
+		if (! pipe_wait_space(pipe_cb, w, limit)) {
+			ret = -1;
+			break;
+		}
+	}
+
+	if (ret > 0) {
+		ring_put(pipe_cb, w, &size, PIPE_RECORD_HEADER);
+		unsigned int pos = w + PIPE_RECORD_HEADER;
+		for (unsigned int k = 0; k < iovcnt; k++) {
+			ring_put(pipe_cb, pos, iov[k].base, iov[k].len);
+			pos += iov[k].len;
+		}
+		pipe_publish(pipe_cb, w + need);
+	}
+
+	Mutex_Unlock(&pipe_cb->write_lock);
+	return ret;
+}
+
+/*
+	Take one record. It is copied into the buffers of iov, or passed to
+	write(out, ...) in one call, and the part that does not fit is dropped.
+ */
+static int packet_take(PIPE_CB* pipe_cb, const iovec_t* iov, unsigned int iovcnt,
+	int (*write)(void*, const char*, unsigned int), void* out, unsigned int size)
+{
+	int nonblock = pipe_cb->reader->flags & FLAG_NONBLOCK;
+	int ret = 0;
+
+	if (iov != NULL)
+		size = iov_size(iov, iovcnt);
+
+	Mutex_Lock(&pipe_cb->read_lock);
+
+	unsigned int r = pipe_cb->r_position;
+
+	// Records are published whole, so data means a whole record
+	while (__atomic_load_n(&pipe_cb->w_position, __ATOMIC_ACQUIRE) == r) {
+		if (nonblock) {
+			if (pipe_cb->writer != NULL) {
+				ret = WOULDBLOCK;
+				goto finish;
+			}
+			if (__atomic_load_n(&pipe_cb->w_position, __ATOMIC_ACQUIRE) == r)
+				goto finish;  // End of data
+		}
+		else if (pipe_wait_data(pipe_cb, r, NULL, 0) < 0)
+			goto finish;      // End of data
+	}
+
+	unsigned int len;
+	ring_get(pipe_cb, r, &len, PIPE_RECORD_HEADER);
+
+	unsigned int n = (len < size) ? len : size;
+	unsigned int pos = r + PIPE_RECORD_HEADER;
+
+	if (iov != NULL) {
+		unsigned int left = n;
+		for (unsigned int k = 0; left > 0; k++) {
+			unsigned int m = (iov[k].len < left) ? iov[k].len : left;
+			ring_get(pipe_cb, pos, iov[k].base, m);
+			pos += m;
+			left -= m;
+		}
+		ret = n;
+	}
+	else {
+		// The output gets the record in one write, so it may be a packet stream too
+		unsigned int off = pos & (pipe_cb->size - 1);
+		if (off + n <= pipe_cb->size)
+			ret = write(out, &pipe_cb->buffer[off], n);
+		else {
+			char* tmp = (char*) xmalloc(n);
+			ring_get(pipe_cb, pos, tmp, n);
+			ret = write(out, tmp, n);
+			free(tmp);
+		}
+		if (ret < 0)  // The record stays in the pipe
+			goto finish;
+	}
+
+	__atomic_store_n(&pipe_cb->r_position, r + PIPE_RECORD_HEADER + len, __ATOMIC_RELEASE);
+	pipe_wake(pipe_cb, &pipe_cb->w_waiting, &pipe_cb->has_space, &pipe_cb->w_pollers, EV_WRITE);
+
+finish:
+	Mutex_Unlock(&pipe_cb->read_lock);
+	return ret;
+}
+
+
+/*
+	Packet mode is a property of the pipe, kept only in pipe_cb->packet.
+	It can be set (or cleared) from either end, as long as nothing has 
+	been written yet. An end changes the mode only when it changes 
+	FLAG_PACKET in its own flags, so that the other end may set its 
+	flags without knowing the mode. SetFlags calls are serialized, so 
+	the flags of the end do not change under us.
+ */
+static int pipe_setflags(PIPE_CB* pipe_cb, FCB* end, int flags) {
+
+	int packet = (flags & FLAG_PACKET) ? 1 : 0;
+	int ret = 0;
+
+	if (flags & FLAG_REUSEPORT)
+		return -1;
+	if (! ((flags ^ end->flags) & FLAG_PACKET))
+		return 0;
+
+	Mutex_Lock(&pipe_cb->write_lock);
+	if (packet != pipe_cb->packet) {
+		if (pipe_cb->w_position != 0)
+			ret = -1;
+		else
+			pipe_cb->packet = packet;
+	}
+	Mutex_Unlock(&pipe_cb->write_lock);
+
+	return ret;
+}
+
+int pipe_reader_setflags(void* _pipecb, int flags) {
+	PIPE_CB* pipe_cb = (PIPE_CB*) _pipecb;
+	return pipe_setflags(pipe_cb, pipe_cb->reader, flags);
+}
+
+int pipe_writer_setflags(void* _pipecb, int flags) {
+	PIPE_CB* pipe_cb = (PIPE_CB*) _pipecb;
+	return pipe_setflags(pipe_cb, pipe_cb->writer, flags);
+}
+
+int pipe_reader_poll(void* _pipecb, poll_table* pt) {
+
+	PIPE_CB* pipe_cb = (PIPE_CB*) _pipecb;
+
+	poll_register(pt, &pipe_cb->r_pollers);
+
+	if (pipe_cb->writer == NULL) // Read returns at once, with what is left
+		return EV_READ | EV_HUP;
+	if (__atomic_load_n(&pipe_cb->w_position, __ATOMIC_ACQUIRE) != pipe_cb->r_position)
+		return EV_READ;
+	return 0;
+}
+
+int pipe_writer_poll(void* _pipecb, poll_table* pt) {
+
+	PIPE_CB* pipe_cb = (PIPE_CB*) _pipecb;
+
+	poll_register(pt, &pipe_cb->w_pollers);
+
+	if (pipe_cb->reader == NULL) // Write fails
+		return EV_HUP;
+	if (pipe_cb->w_position - __atomic_load_n(&pipe_cb->r_position, __ATOMIC_ACQUIRE) < pipe_cb->size)
+		return EV_WRITE;
+	return 0;
+}
+
 int pipe_writer_close(void* _pipecb) { // Test failure on read?
 
 	PIPE_CB* pipe_cb = (PIPE_CB*) _pipecb;
 	if (pipe_cb == NULL) // Invalid file id
 		return -1;
 
+	Mutex_Lock(&pipe_cb->lock);
 	pipe_cb->writer = NULL;
 	
 	if (pipe_cb->reader != NULL) {
 		kernel_broadcast(&pipe_cb->has_data);
+		poll_notify(&pipe_cb->r_pollers, EV_READ | EV_HUP);
+		Mutex_Unlock(&pipe_cb->lock);
 		return 0;
 	}
-	free(pipe_cb);
+	Mutex_Unlock(&pipe_cb->lock);
+	free_PIPE_CB(pipe_cb);
 	return 0; //success
 }
 
@@ -165,49 +820,30 @@ int pipe_reader_close(void* _pipecb) {
 	if (pipe_cb == NULL) // Invalid file id
 		return -1;
 
+	Mutex_Lock(&pipe_cb->lock);
 	pipe_cb->reader = NULL;
 	
 	if (pipe_cb->writer != NULL) {
 		kernel_broadcast(&pipe_cb->has_space);
+		poll_notify(&pipe_cb->w_pollers, EV_WRITE | EV_HUP);
+		Mutex_Unlock(&pipe_cb->lock);
 		return 0;
 	}
-	free(pipe_cb);
+	Mutex_Unlock(&pipe_cb->lock);
+	free_PIPE_CB(pipe_cb);
 	return 0;
 }
 
-PIPE_CB* initialize_socket_pipe() { // Initialization without FCB/Fid for socket use
-  // Allocate memory for the PIPE_CB structure
-    PIPE_CB* pipecb = (PIPE_CB *)xmalloc(sizeof(PIPE_CB));
-    if (pipecb == NULL)
-        return NULL;
-
-    // Allocate memory for the FCB structures
-    FCB* fcb[2];
-    fcb[0] = (FCB *)xmalloc(sizeof(FCB)); // Allocate reader FCB
-    fcb[1] = (FCB *)xmalloc(sizeof(FCB)); // Allocate writer FCB
-
-    // Check for allocation failure and clean up if necessary
-		if (fcb[0] == NULL || fcb[1] == NULL) {
-
-    	if (fcb[0] != NULL) {
-        free(fcb[0]); // Free allocated reader
-    }
-    	if (fcb[1] != NULL) {
-        free(fcb[1]); // Free allocated writer
-    }
-    
-    free(pipecb); // Free the PIPE_CB structure
-    return NULL;  // Return NULL to indicate failure
-}
-
-    // Initialize the PIPE_CB fields
-    pipecb->reader = fcb[0];
-    pipecb->writer = fcb[1];
-    pipecb->current_size = 0;
-    pipecb->r_position = 0;
-    pipecb->w_position = 0;
-    pipecb->has_data = COND_INIT;
-    pipecb->has_space = COND_INIT;
-
-    return pipecb;
+/*
+	A pipe for a pair of connected sockets. Its ends are the FCBs of
+	the reading and the writing socket, so that it follows their flags.
+ */
+PIPE_CB* initialize_socket_pipe(FCB* reader, FCB* writer, int packet) {
+	PIPE_CB* pipecb = pipe_cache_get();
+
+	// The buffer is allocated on first write, unless it is cached
+	initialize_PIPE_CB(pipecb, reader, writer, PIPE_BUFFER_SIZE);
+	pipecb->packet = packet;
+
+	return pipecb;
 }
@@ -6,39 +6,110 @@
 #include "kernel_dev.h"
 #include "kernel_cc.h"
 
-#define PIPE_BUFFER_SIZE 16500
+/** @brief The default size of the pipe ring buffer. */
+#define PIPE_BUFFER_SIZE 16384
+
+/** @brief The smallest pipe buffer. */
+#define PIPE_BUFFER_MIN 512
+
+/** @brief The largest pipe buffer. Pipes grow up to this size under load. */
+#define PIPE_BUFFER_MAX (256*1024)
+
+/** @brief How long (in usec) a pipe stays empty before its ring is freed. */
+#define PIPE_IDLE_TIMEOUT 100000
+
+/** @brief The maximum number of free pipes kept for reuse. */
+#ifndef PIPE_CACHE_MAX
+#define PIPE_CACHE_MAX 64
+#endif
+
+/** @brief The size of the length of a record, in packet mode. */
+#define PIPE_RECORD_HEADER sizeof(unsigned int)
 
 /**
  * @brief Structure representing a pipe control block.
  * 
  * This structure contains the necessary fields to manage a pipe, including
  * the reader and writer control blocks, condition variables for space and data,
- * positions for writing and reading, current size, and a buffer to hold the data.
+ * positions for writing and reading, and a ring buffer to hold the data.
+ *
+ * The buffer is a single-producer, single-consumer ring. The positions are
+ * free-running counters, and the ring holds @c w_position - @c r_position bytes.
+ * Data moves without taking @c lock, which is only used to sleep when
+ * the ring is empty or full, and to close the pipe.
+ *
+ * The ring is allocated by the first write. Its size is a power of two,
+ * starting at @c base_size. The writer doubles it (up to @c PIPE_BUFFER_MAX)
+ * when it finds it full, and a reader that sleeps on an empty ring 
+ * frees it. The ring is only replaced while it is empty, by a thread
+ * holding @c write_lock.
+ *
+ * A writer that finds the ring empty and the reader asleep copies its
+ * data directly into the reader's buffer (@c r_buf), bypassing the ring.
+ *
+ * In packet mode, each write is stored in the ring as one record, 
+ * a length (@c PIPE_RECORD_HEADER bytes) followed by the data, and 
+ * it is published at once. Each read takes one record.
  */
 typedef struct pipe_control_block{
+	Mutex lock;             /**< Protects @c reader, @c writer and the handoff, held to sleep */
+
 	FCB* reader;            /**< Pointer to the reader control block */
 	FCB* writer;            /**< Pointer to the writer control block */
 
 	CondVar has_space;      /**< Condition variable to signal availability of space in the pipe */
 	CondVar has_data;       /**< Condition variable to signal availability of data in the pipe */
 
-	int w_position;         /**< Position for writing in the buffer */
-	int r_position;         /**< Position for reading from the buffer */
-	int current_size;       /**< Current size of the data in the buffer */
+	int r_waiting;          /**< Set while the reader sleeps on @c has_data */
+	int w_waiting;          /**< Set while the writer sleeps on @c has_space */
+
+	char* r_buf;            /**< Buffer of the sleeping reader, for direct handoff */
+	unsigned int r_want;    /**< Size of @c r_buf */
+	unsigned int r_got;     /**< Bytes handed off into @c r_buf */
+
+	Mutex read_lock;        /**< Serializes the threads that read the pipe */
+	Mutex write_lock;       /**< Serializes the threads that write the pipe */
+
+	unsigned int w_position; /**< Position for writing, advanced by the writer only */
+	unsigned int r_position; /**< Position for reading, advanced by the reader only */
+
+	char* buffer;           /**< Ring buffer to hold the data, or NULL */
+	unsigned int size;      /**< Size of @c buffer, a power of two */
+	unsigned int base_size; /**< Size of @c buffer when it is allocated */
 
-	char buffer[PIPE_BUFFER_SIZE];   /**< Buffer to hold the data */
+	int packet;             /**< Set in packet mode */
+
+	rlnode r_pollers;       /**< Pollers of the read end, notified with @c has_data */
+	rlnode w_pollers;       /**< Pollers of the write end, notified with @c has_space */
 } PIPE_CB;
 
 int sys_Pipe(pipe_t* pipe);
 
+int sys_PipeWithSize(pipe_t* pipe, unsigned int size);
+
 int pipe_write(void* pipecb_t, const char* buf, unsigned int size);
 
 int pipe_read(void* pipecb_t, char* buf, unsigned int size);
 
+int pipe_writev(void* pipecb_t, const iovec_t* iov, unsigned int iovcnt);
+
+int pipe_readv(void* pipecb_t, const iovec_t* iov, unsigned int iovcnt);
+
+int pipe_splice(void* pipecb_t, int (*write)(void*, const char*, unsigned int), 
+	void* out, unsigned int size);
+
+int pipe_reader_setflags(void* _pipecb, int flags);
+
+int pipe_writer_setflags(void* _pipecb, int flags);
+
+int pipe_reader_poll(void* _pipecb, poll_table* pt);
+
+int pipe_writer_poll(void* _pipecb, poll_table* pt);
+
 int pipe_writer_close(void* _pipecb);
 
 int pipe_reader_close(void* _pipecb);
 
-PIPE_CB* initialize_socket_pipe();
+PIPE_CB* initialize_socket_pipe(FCB* reader, FCB* writer, int packet);
 
 #endif
\ No newline at end of file
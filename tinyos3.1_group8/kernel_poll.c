@@ -0,0 +1,526 @@
+
+#include "tinyos.h"
+#include "kernel_poll.h"
+#include "kernel_streams.h"
+#include "kernel_cc.h"
+#include "kernel_sched.h"
+
+/*
+	The poll queues are protected by an array of locks, each lock covering 
+	the queues whose address hashes to it. The locks outlive the queues, 
+	so that an entry can be removed after its queue has been detached and
+	freed (e.g., a pipe). They are only taken with preemption off.
+ */
+#define POLL_LOCKS 64
+static Mutex poll_locks[POLL_LOCKS];
+
+static inline Mutex* poll_lock(rlnode* queue)
+{
+	return &poll_locks[((uintptr_t) queue / sizeof(rlnode)) % POLL_LOCKS];
+}
+
+
+void poll_register(poll_table* pt, rlnode* queue)
+{
+	if (pt == NULL)
+		return;
+
+	assert(pt->count < pt->max);
+	poll_entry* e = &pt->entries[pt->count++];
+	rlnode_init(&e->node, e);
+	e->notify = pt->notify;
+	e->owner = pt->owner;
+	e->events = pt->events | EV_HUP;
+
+	int pre = preempt_off;
+	Mutex_Lock(poll_lock(queue));
+	rlist_push_back(queue, &e->node);
+	e->queue = queue;
+	Mutex_Unlock(poll_lock(queue));
+	if (pre) preempt_on;
+
+	/* The caller checks the state of the stream after this */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+void poll_notify(rlnode* queue, int events)
+{
+	/* Pairs with the fence of poll_register */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&queue->next, __ATOMIC_RELAXED) == queue)
+		return;
+
+	int pre = preempt_off;
+	Mutex_Lock(poll_lock(queue));
+	for (rlnode* n = queue->next; n != queue; n = n->next) {
+		poll_entry* e = n->obj;
+		if (e->events & events)
+			e->notify(e, events & e->events);
+	}
+	Mutex_Unlock(poll_lock(queue));
+	if (pre) preempt_on;
+}
+
+
+void poll_detach(rlnode* queue)
+{
+	int pre = preempt_off;
+	Mutex_Lock(poll_lock(queue));
+	while (!is_rlist_empty(queue)) {
+		poll_entry* e = rlist_pop_front(queue)->obj;
+		__atomic_store_n(&e->queue, NULL, __ATOMIC_RELAXED);
+	}
+	Mutex_Unlock(poll_lock(queue));
+	if (pre) preempt_on;
+}
+
+
+/* Remove an entry from its queue, unless the queue has been detached */
+static void poll_entry_remove(poll_entry* e)
+{
+	rlnode* queue;
+	while ((queue = __atomic_load_n(&e->queue, __ATOMIC_RELAXED)) != NULL) {
+		Mutex_Lock(poll_lock(queue));
+		int found = (e->queue == queue);
+		if (found) {
+			rlist_remove(&e->node);
+			e->queue = NULL;
+		}
+		Mutex_Unlock(poll_lock(queue));
+		if (found) break;
+	}
+}
+
+
+/* Remove the entries of a table from their queues */
+static void poll_unregister(poll_entry* entries, unsigned int count)
+{
+	int pre = preempt_off;
+	for (unsigned int k = 0; k < count; k++)
+		poll_entry_remove(&entries[k]);
+	if (pre) preempt_on;
+}
+
+
+/*
+	Sleep on cv, with mx held, until signalled or until the deadline. 
+	Returns 0 if the deadline has passed.
+ */
+static int poll_sleep(Mutex* mx, CondVar* cv, timeout_t timeout, TimerDuration deadline)
+{
+	if (timeout == (timeout_t) -1) {
+		kernel_wait(mx, cv, SCHED_POLL);
+		return 1;
+	}
+
+	TimerDuration now = bios_clock();
+	return now < deadline && kernel_timedwait(mx, cv, SCHED_POLL, deadline - now);
+}
+
+
+/* The notify of the entries of Poll: wake the thread up, once */
+static void poll_wakeup(poll_entry* e, int events)
+{
+	poll_waiter* waiter = e->owner;
+	Mutex_Lock(&waiter->lock);
+	if (!waiter->woken) {
+		waiter->woken = 1;
+		kernel_signal(&waiter->cv);
+	}
+	Mutex_Unlock(&waiter->lock);
+}
+
+
+int sys_Poll(pollfid_t* fids, unsigned int n, timeout_t timeout)
+{
+	if (fids == NULL && n > 0)
+		return -1;
+
+	/* Hold a reference to each stream, so that it stays open while we poll */
+	FCB** fcbs = (n > 0) ? (FCB**) xmalloc(n * sizeof(FCB*)) : NULL;
+	for (unsigned int i = 0; i < n; i++)
+		fcbs[i] = (fids[i].fid >= 0) ? get_fcb_ref(fids[i].fid) : NULL;
+
+	poll_waiter waiter = { .lock = MUTEX_INIT, .cv = COND_INIT, .woken = 0 };
+	poll_table table = {
+		.notify = poll_wakeup,
+		.owner = &waiter,
+		.entries = (n > 0) ? (poll_entry*) xmalloc(n * POLL_QUEUES_PER_STREAM * sizeof(poll_entry)) : NULL,
+		.count = 0,
+		.max = n * POLL_QUEUES_PER_STREAM
+	};
+
+	/* The first pass registers on the queues, later passes only check */
+	poll_table* pt = &table;
+
+	TimerDuration deadline = bios_clock() + timeout * 1000ul;
+	int ready;
+
+	for (;;) {
+		ready = 0;
+		for (unsigned int i = 0; i < n; i++) {
+			fids[i].revents = 0;
+			if (fids[i].fid < 0)
+				continue;
+			if (fcbs[i] == NULL)
+				fids[i].revents = EV_INVAL;
+			else {
+				table.events = fids[i].events & (EV_READ | EV_WRITE);
+				fids[i].revents = FCB_poll(fcbs[i], pt) & (table.events | EV_HUP);
+			}
+			if (fids[i].revents)
+				ready++;
+		}
+		pt = NULL;
+
+		if (ready > 0 || timeout == 0)
+			break;
+
+		/* Sleep until a stream changes state */
+		int timedout = 0;
+		int pre = preempt_off;
+		Mutex_Lock(&waiter.lock);
+		while (!waiter.woken && !timedout)
+			timedout = !poll_sleep(&waiter.lock, &waiter.cv, timeout, deadline);
+		waiter.woken = 0;
+		Mutex_Unlock(&waiter.lock);
+		if (pre) preempt_on;
+
+		if (timedout) {
+			/* A last check, for a state change that raced with the timeout */
+			timeout = 0;
+		}
+	}
+
+	poll_unregister(table.entries, table.count);
+
+	for (unsigned int i = 0; i < n; i++)
+		if (fcbs[i]) FCB_decref(fcbs[i]);
+
+	free(table.entries);
+	free(fcbs);
+	return ready;
+}
+
+
+
+/*
+	Event queues.
+
+	Each stream added to an event queue has an evq_item, whose entries 
+	stay registered on the queues of the stream. A notification adds the
+	item to the ready list of the event queue (under its ready_lock), and 
+	EventWait only looks at the ready list. Thus, a wait costs O(ready),
+	no matter how many streams are registered.
+
+	Events are edge-triggered: an item is reported once per notification,
+	and its events are cleared by EventWait.
+
+	Items are identified by the FCB of the stream, and do not hold it open.
+	Each item is in the items list of its event queue and in the evq_items 
+	list of its FCB. When the FCB is closed, evq_stream_closed() removes its
+	items from their event queues. Both lists are protected by 
+	evq_items_lock. It is not held while polling the streams, since a 
+	stream may be closed (and call evq_stream_closed) with its own lock held.
+ */
+
+typedef struct event_queue event_queue;
+
+typedef struct evq_item {
+	rlnode node;            /* Node in evq->items */
+	rlnode ready_node;      /* Node in evq->ready, self-linked when not ready */
+	event_queue* evq;
+
+	Fid_t fid;              /* The fid given to EventCtl(ADD), returned by EventWait */
+	FCB* fcb;               /* The registered stream */
+	rlnode fcb_node;        /* Node in fcb->evq_items */
+	int events;             /* Events of interest */
+	int revents;            /* Events since the last EventWait */
+
+	poll_entry entries[POLL_QUEUES_PER_STREAM];
+	unsigned int nentries;
+} evq_item;
+
+struct event_queue {
+	Mutex lock;             /* Serializes EventCtl */
+	rlnode items;           /* All items, under evq_items_lock */
+	Mutex ready_lock;       /* Protects ready and the revents of items, taken with preemption off */
+	rlnode ready;           /* Items with events */
+	CondVar ready_cv;       /* EventWait sleeps here, with ready_lock */
+};
+
+
+/* Protects the items lists of the event queues and of the FCBs */
+static Mutex evq_items_lock = MUTEX_INIT;
+
+/* Report events on an item. Called with preemption off. */
+static void evq_ready(evq_item* item, int events)
+{
+	event_queue* evq = item->evq;
+	Mutex_Lock(&evq->ready_lock);
+	item->revents |= events & (item->events | EV_HUP);
+	if (item->revents && is_rlist_empty(&item->ready_node)) {
+		rlist_push_back(&evq->ready, &item->ready_node);
+		kernel_signal(&evq->ready_cv);
+	}
+	Mutex_Unlock(&evq->ready_lock);
+}
+
+/* The notify of the entries of an item */
+static void evq_notify(poll_entry* e, int events)
+{
+	evq_ready((evq_item*) e->owner, events);
+}
+
+/* Report the current state of the stream of an item */
+static void evq_check(evq_item* item, int events)
+{
+	int pre = preempt_off;
+	evq_ready(item, events);
+	if (pre) preempt_on;
+}
+
+/* Unregister and free an item, which is no longer in any list */
+static void evq_item_free(evq_item* item)
+{
+	/* After this, no notification can add the item to the ready list */
+	poll_unregister(item->entries, item->nentries);
+
+	int pre = preempt_off;
+	Mutex_Lock(&item->evq->ready_lock);
+	rlist_remove(&item->ready_node);
+	Mutex_Unlock(&item->evq->ready_lock);
+	if (pre) preempt_on;
+
+	free(item);
+}
+
+
+/* Unlink an item from its lists. Called with evq_items_lock held. */
+static void evq_item_unlink(evq_item* item)
+{
+	rlist_remove(&item->node);
+	rlist_remove(&item->fcb_node);
+}
+
+
+void evq_stream_closed(FCB* fcb)
+{
+	Mutex_Lock(&evq_items_lock);
+	while (!is_rlist_empty(&fcb->evq_items)) {
+		evq_item* item = fcb->evq_items.next->obj;
+		evq_item_unlink(item);
+		evq_item_free(item);
+	}
+	Mutex_Unlock(&evq_items_lock);
+}
+
+
+static int evq_close(void* this)
+{
+	event_queue* evq = (event_queue*) this;
+
+	/* Nobody else can use the queue now, but its streams may be closing */
+	Mutex_Lock(&evq_items_lock);
+	while (!is_rlist_empty(&evq->items)) {
+		evq_item* item = evq->items.next->obj;
+		evq_item_unlink(item);
+		evq_item_free(item);
+	}
+	Mutex_Unlock(&evq_items_lock);
+
+	free(evq);
+	return 0;
+}
+
+static file_ops evq_file_ops = {
+	.Open = NULL,
+	.Read = NULL,
+	.Write = NULL,
+	.Close = evq_close
+};
+
+
+/* Return the event queue of a fid with a reference on its FCB, or NULL */
+static event_queue* get_evq(Fid_t fid, FCB** fcb)
+{
+	*fcb = get_fcb_ref(fid);
+	if (*fcb == NULL)
+		return NULL;
+	if ((*fcb)->streamfunc != &evq_file_ops) {
+		FCB_decref(*fcb);
+		return NULL;
+	}
+	return (event_queue*) (*fcb)->streamobj;
+}
+
+
+Fid_t sys_EventQueue()
+{
+	Fid_t fid;
+	FCB* fcb;
+
+	if (! FCB_reserve(1, &fid, &fcb))
+		return NOFILE;
+
+	event_queue* evq = (event_queue*) xmalloc(sizeof(event_queue));
+	evq->lock = MUTEX_INIT;
+	evq->ready_lock = MUTEX_INIT;
+	rlnode_new(&evq->items);
+	rlnode_new(&evq->ready);
+	evq->ready_cv = COND_INIT;
+
+	FCB_setup(fcb, evq, &evq_file_ops);
+	return fid;
+}
+
+
+int sys_EventCtl(Fid_t evqfid, evq_op op, Fid_t fid, int events)
+{
+	FCB* evqfcb;
+	event_queue* evq = get_evq(evqfid, &evqfcb);
+	if (evq == NULL)
+		return -1;
+
+	/* The stream stays open while we hold this reference */
+	FCB* fcb = get_fcb_ref(fid);
+	if (fcb == NULL) {
+		FCB_decref(evqfcb);
+		return -1;
+	}
+
+	int ret = -1;
+	events &= (EV_READ | EV_WRITE);
+
+	Mutex_Lock(&evq->lock);
+
+	Mutex_Lock(&evq_items_lock);
+	evq_item* item = NULL;
+	for (rlnode* n = fcb->evq_items.next; n != &fcb->evq_items; n = n->next)
+		if (((evq_item*) n->obj)->evq == evq) {
+			item = n->obj;
+			break;
+		}
+
+	switch (op) {
+	case EVQ_ADD: {
+		if (item != NULL || fcb->streamfunc == &evq_file_ops) // No event queues in event queues
+			break;
+
+		item = (evq_item*) xmalloc(sizeof(evq_item));
+		rlnode_init(&item->node, item);
+		rlnode_init(&item->ready_node, item);
+		rlnode_init(&item->fcb_node, item);
+		item->evq = evq;
+		item->fid = fid;
+		item->fcb = fcb;
+		item->events = events;
+		item->revents = 0;
+		item->nentries = 0;
+		rlist_push_back(&evq->items, &item->node);
+		rlist_push_back(&fcb->evq_items, &item->fcb_node);
+		ret = 0;
+		break;
+	}
+
+	case EVQ_MOD:
+		ret = (item != NULL) ? 0 : -1;
+		break;
+
+	case EVQ_DEL:
+		if (item == NULL)
+			break;
+		evq_item_unlink(item);
+		ret = 0;
+		break;
+	}
+
+	Mutex_Unlock(&evq_items_lock);
+
+	/* 
+		The item cannot go away while we hold evq->lock and the reference
+		to the stream, since only EventCtl and closing the stream remove it.
+	 */
+	if (ret == 0 && op == EVQ_ADD) {
+		poll_table table = {
+			.notify = evq_notify,
+			.owner = item,
+			.events = events,
+			.entries = item->entries,
+			.count = 0,
+			.max = POLL_QUEUES_PER_STREAM
+		};
+		int state = FCB_poll(fcb, &table);
+		item->nentries = table.count;
+
+		evq_check(item, state);
+	}
+	else if (ret == 0 && op == EVQ_MOD) {
+		int pre = preempt_off;
+		for (unsigned int k = 0; k < item->nentries; k++) {
+			poll_entry* e = &item->entries[k];
+			rlnode* queue = __atomic_load_n(&e->queue, __ATOMIC_RELAXED);
+			if (queue != NULL) Mutex_Lock(poll_lock(queue));
+			e->events = events | EV_HUP;
+			if (queue != NULL) Mutex_Unlock(poll_lock(queue));
+		}
+		Mutex_Lock(&evq->ready_lock);
+		item->events = events;
+		item->revents &= (events | EV_HUP);
+		Mutex_Unlock(&evq->ready_lock);
+		if (pre) preempt_on;
+
+		evq_check(item, FCB_poll(fcb, NULL));
+	}
+	else if (ret == 0 && op == EVQ_DEL)
+		evq_item_free(item);
+
+	Mutex_Unlock(&evq->lock);
+
+	/* If the fid was closed meanwhile, this closes the stream */
+	FCB_decref(fcb);
+	FCB_decref(evqfcb);
+	return ret;
+}
+
+
+int sys_EventWait(Fid_t evqfid, pollfid_t* events, unsigned int max, timeout_t timeout)
+{
+	if (events == NULL || max == 0)
+		return -1;
+
+	FCB* evqfcb;
+	event_queue* evq = get_evq(evqfid, &evqfcb);
+	if (evq == NULL)
+		return -1;
+
+	TimerDuration deadline = bios_clock() + timeout * 1000ul;
+	int n = 0;
+
+	int pre = preempt_off;
+	Mutex_Lock(&evq->ready_lock);
+
+	int timedout = (timeout == 0);
+	while (is_rlist_empty(&evq->ready) && !timedout)
+		timedout = !poll_sleep(&evq->ready_lock, &evq->ready_cv, timeout, deadline);
+
+	while (n < max && !is_rlist_empty(&evq->ready)) {
+		evq_item* item = rlist_pop_front(&evq->ready)->obj;
+		events[n].fid = item->fid;
+		events[n].events = item->events;
+		events[n].revents = item->revents;
+		item->revents = 0;
+		n++;
+	}
+
+	/* Pass the rest to another waiter */
+	if (!is_rlist_empty(&evq->ready))
+		kernel_signal(&evq->ready_cv);
+
+	Mutex_Unlock(&evq->ready_lock);
+	if (pre) preempt_on;
+
+	FCB_decref(evqfcb);
+	return n;
+}
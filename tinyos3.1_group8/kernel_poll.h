@@ -0,0 +1,113 @@
+#ifndef __KERNEL_POLL_H
+#define __KERNEL_POLL_H
+
+#include "tinyos.h"
+#include "util.h"
+
+/**
+	@file kernel_poll.h
+	@brief Readiness notification for streams.
+
+	@defgroup poll Polling.
+	@ingroup kernel
+	@brief Readiness notification for streams.
+
+	The @c Poll system call asks each stream for its readiness through
+	the @c Poll method of its @c file_ops. While doing so, the stream
+	registers a @c poll_entry on a queue (an @c rlnode list head),
+	by calling @ref poll_register. A stream calls @ref poll_notify on
+	the queue when its state changes, and this calls the @c notify
+	function of the entries interested in the events. 
+
+	For @c Poll, this wakes up the polling thread. An event queue 
+	(see @c EventQueue) keeps its entries registered, and @c notify 
+	adds the stream to the ready list of the queue.
+
+	The queues are protected by internal locks, each covering the queues 
+	whose address hashes to it, so that notifications on unrelated streams
+	do not contend. A @c Poll call and an event queue have their own lock,
+	which a notification takes after the queue lock. These locks are taken
+	last, with preemption off (the serial driver notifies from its 
+	interrupt handler). A queue must be detached by @ref poll_detach
+	before it is freed.
+
+	@{
+*/
+
+
+/** @brief A thread sleeping in @c Poll. */
+typedef struct poll_waiter {
+	Mutex lock;        /**< @brief Protects @c woken */
+	CondVar cv;        /**< @brief Where the thread sleeps */
+	int woken;         /**< @brief Set by the first notification */
+} poll_waiter;
+
+
+/** @brief The registration of a poller on a stream queue. */
+typedef struct poll_entry {
+	rlnode node;            /**< @brief Node in the queue of the stream */
+	rlnode* queue;          /**< @brief The queue, or NULL if removed or detached */
+	void (*notify)(struct poll_entry*, int events);  /**< @brief Called with the events that occurred */
+	void* owner;            /**< @brief The poller, for @c notify */
+	int events;             /**< @brief The events of interest */
+} poll_entry;
+
+
+/**
+	@brief A set of registrations, of a @c Poll call or an event queue.
+
+	This is passed to the @c Poll method of a stream. If it is NULL,
+	the method only returns the readiness of the stream.
+ */
+typedef struct poll_table {
+	void (*notify)(poll_entry*, int events);  /**< @brief The @c notify of new entries */
+	void* owner;            /**< @brief The @c owner of new entries */
+	int events;             /**< @brief The events of interest for the current stream */
+	poll_entry* entries;    /**< @brief The registrations */
+	unsigned int count;     /**< @brief Number of entries used */
+	unsigned int max;       /**< @brief Number of entries available */
+} poll_table;
+
+
+/** @brief The maximum number of queues that a stream may register on */
+#define POLL_QUEUES_PER_STREAM 2
+
+
+/**
+	@brief Register the poller of @c pt on a queue.
+
+	A stream's @c Poll method calls this before it checks its state,
+	so that a change after the check is not missed.
+	If @c pt is NULL, nothing is done.
+ */
+void poll_register(poll_table* pt, rlnode* queue);
+
+
+/**
+	@brief Notify the pollers of a queue about some events.
+
+	This is cheap when there are no pollers. The caller must have
+	published the state change before the call. The @c notify 
+	functions are called with the lock of the queue held.
+ */
+void poll_notify(rlnode* queue, int events);
+
+
+/**
+	@brief Remove all pollers from a queue, before it is freed.
+ */
+void poll_detach(rlnode* queue);
+
+struct file_control_block;
+
+/**
+	@brief Remove a stream from the event queues it is in.
+
+	This is called when the last reference to the FCB of the stream is 
+	dropped, before the stream is closed.
+ */
+void evq_stream_closed(struct file_control_block* fcb);
+
+/** @} */
+
+#endif
@@ -18,6 +18,8 @@
 PCB PT[MAX_PROC];
 unsigned int process_count;
 
+Mutex proc_lock = MUTEX_INIT;
+
 PCB *get_pcb(Pid_t pid)
 {
   return PT[pid].pstate == FREE ? NULL : &PT[pid];
@@ -76,7 +78,7 @@ void initialize_processes()
 }
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_lock held
 */
 PCB *acquire_PCB()
 {
@@ -94,7 +96,7 @@ PCB *acquire_PCB()
 }
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_lock held
 */
 void release_PCB(PCB *pcb)
 {
@@ -145,6 +147,8 @@ Pid_t sys_Exec(Task call, int argl, void *args)
 {
   PCB *curproc, *newproc;
 
+  Mutex_Lock(&proc_lock);
+
   /* The new process PCB */
   newproc = acquire_PCB();
 
@@ -167,12 +171,7 @@ Pid_t sys_Exec(Task call, int argl, void *args)
     rlist_push_front(&curproc->children_list, &newproc->children_node);
 
     /* Inherit file streams from parent */
-    for (int i = 0; i < MAX_FILEID; i++)
-    {
-      newproc->FIDT[i] = curproc->FIDT[i];
-      if (newproc->FIDT[i])
-        FCB_incref(newproc->FIDT[i]);
-    }
+    FIDT_copy(newproc->FIDT, curproc->FIDT);
   }
 
   /* Set the main thread's function */
@@ -218,6 +217,7 @@ Pid_t sys_Exec(Task call, int argl, void *args)
   }
 
 finish:
+  Mutex_Unlock(&proc_lock);
   return get_pid(newproc);
 }
 
@@ -229,7 +229,11 @@ Pid_t sys_GetPid()
 
 Pid_t sys_GetPPid()
 {
-  return get_pid(CURPROC->parent);
+  /* The parent may change, if it exits */
+  Mutex_Lock(&proc_lock);
+  Pid_t ppid = get_pid(CURPROC->parent);
+  Mutex_Unlock(&proc_lock);
+  return ppid;
 }
 
 static void cleanup_zombie(PCB *pcb, int *status)
@@ -263,7 +267,7 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int *status)
 
   /* Ok, child is a legal child of mine. Wait for it to exit. */
   while (child->pstate == ALIVE)
-    kernel_wait(&parent->child_exit, SCHED_USER);
+    kernel_wait(&proc_lock, &parent->child_exit, SCHED_USER);
 
   cleanup_zombie(child, status);
 
@@ -289,7 +293,7 @@ static Pid_t wait_for_any_child(int *status)
     if (has_exited)
       break;
 
-    kernel_wait(&parent->child_exit, SCHED_USER);
+    kernel_wait(&proc_lock, &parent->child_exit, SCHED_USER);
   }
 
   if (no_children)
@@ -305,16 +309,21 @@ static Pid_t wait_for_any_child(int *status)
 
 Pid_t sys_WaitChild(Pid_t cpid, int *status)
 {
+  Mutex_Lock(&proc_lock);
+
   /* Wait for specific child. */
   if (cpid != NOPROC)
   {
-    return wait_for_specific_child(cpid, status);
+    cpid = wait_for_specific_child(cpid, status);
   }
   /* Wait for any child */
   else
   {
-    return wait_for_any_child(status);
+    cpid = wait_for_any_child(status);
   }
+
+  Mutex_Unlock(&proc_lock);
+  return cpid;
 }
 
 void sys_Exit(int exitval)
@@ -349,8 +358,7 @@ Fid_t sys_OpenInfo()
   procinfo_cb* procinfocb = (procinfo_cb*) xmalloc(sizeof(procinfo_cb));
   procinfocb->pcb_cursor = 0;
 
-  fcb->streamobj = procinfocb;
-  fcb->streamfunc = &procinfo_ops;
+  FCB_setup(fcb, procinfocb, &procinfo_ops);
 
   return fid;
 }
@@ -365,6 +373,8 @@ int procinfo_read(void* procinfo_cb_t, char* buf, unsigned int n) {
 
   procinfo proc_info = procinfocb->procinfo;
 
+  Mutex_Lock(&proc_lock);
+
   PCB* pcb = &PT[procinfocb->pcb_cursor];
 
   // Skip processes marked as FREE
@@ -372,6 +382,7 @@ int procinfo_read(void* procinfo_cb_t, char* buf, unsigned int n) {
     procinfocb->pcb_cursor++;
     if (procinfocb->pcb_cursor >= MAX_PROC){
       // End of process table reached without finding a valid process
+      Mutex_Unlock(&proc_lock);
       return -1;
     }
         
@@ -384,6 +395,8 @@ int procinfo_read(void* procinfo_cb_t, char* buf, unsigned int n) {
     memcpy(&proc_info.args, pcb->args, proc_info.argl);
   }
 
+  Mutex_Unlock(&proc_lock);
+
   // Copy the process information to the buffer
   memcpy(buf, &proc_info, sizeof(proc_info));
 
@@ -118,6 +118,17 @@ PCB* get_pcb(Pid_t pid);
 */
 Pid_t get_pid(PCB* pcb);
 
+
+/**
+  @brief The process lock.
+
+  This mutex protects the process table, the process tree
+  (parents, children and exited lists), the PTCB list and
+  @c thread_count of every process, and the PTCB fields used by
+  @c ThreadJoin and @c ThreadDetach.
+*/
+extern Mutex proc_lock;
+
 /** @} */
 
 #endif
@@ -34,8 +34,7 @@ CCB cctx[MAX_CORES];
 */
 #define CURTHREAD (CURCORE.current_thread)
 
-#define PRIORITY_QUEUES 10	// number of queues
-#define MAX_CALLS 90	// max calls of yield() until we boost each thread's priority by 1
+#define MAX_CALLS 90	// max calls of yield() on a core until we boost each thread's priority by 1
 /*
 	This can be used in the preemptive context to
 	obtain the current thread.
@@ -53,35 +52,46 @@ TCB *cur_thread()
    The thread layout.
   --------------------
 
-  On the x86 (Pentium) architecture, the stack grows upward. Therefore, we
-  can allocate the TCB at the top of the memory block used as the stack.
+  On the x86 (Pentium) architecture, the stack grows downward. Therefore, we
+  allocate the TCB at the bottom of the memory block used by the thread, and
+  separate it from the stack by a guard page.
 
+  +-------------+  <- top of the block
+  | first frame |
   +-------------+
-  |   TCB       |
-  +-------------+
+  |      |      |
+  |      v      |
   |             |
   |    stack    |
   |             |
-  |      ^      |
-  |      |      |
   +-------------+
-  | first frame |
+  | guard page  |
+  +-------------+
+  |   TCB       |
   +-------------+
 
-  Advantages: (a) unified memory area for stack and TCB (b) stack overrun will
-  crash own thread, before it affects other threads (which may make debugging
-  easier).
+  The block is mapped with mmap, without reserving swap space. Only the pages
+  that are actually touched are committed, so an idle thread costs the TCB
+  page(s) and the few pages at the top of its stack.
+
+  Advantages: (a) unified memory area for stack and TCB (b) a stack overrun
+  hits the guard page, which is mapped PROT_NONE, and crashes the thread
+  before it corrupts the TCB or any other memory.
 
   Disadvantages: The stack cannot grow unless we move the whole TCB. Of course,
-  we do not support stack growth anyway!
+  we do not support stack growth anyway! Also, the guard page splits the block
+  in two memory mappings, which count against the host's vm.max_map_count.
  */
 
 /*
   A counter for active threads. By "active", we mean 'existing',
   with the exception of idle threads (they don't count).
+
+  It is updated atomically, without a lock: it is decremented in gain(),
+  where a lock held by a preempted thread of the same core would spin
+  forever.
  */
 volatile unsigned int active_threads = 0;
-Mutex active_threads_spinlock = MUTEX_INIT;
 
 /* This is specific to Intel Pentium! */
 #define SYSTEM_PAGE_SIZE (1 << 12)
@@ -90,41 +100,37 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 #define THREAD_TCB_SIZE \
 	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
+/* The size of the guard page between the TCB and the stack */
+#define THREAD_GUARD_SIZE SYSTEM_PAGE_SIZE
 
-// #define MMAPPED_THREAD_MEM
-#ifdef MMAPPED_THREAD_MEM
+/* The size of a thread's memory block, for a given stack size */
+#define THREAD_SIZE(stack_size) (THREAD_TCB_SIZE + THREAD_GUARD_SIZE + (stack_size))
 
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+  Use mmap to allocate a thread with a stack of the given size (a multiple of
+  SYSTEM_PAGE_SIZE). Return NULL if the memory cannot be mapped.
  */
-void free_thread(void *ptr, size_t size) { CHECK(munmap(ptr, size)); }
-
-void *allocate_thread(size_t size)
+static void *allocate_thread(size_t stack_size)
 {
-	void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-					 MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	void *ptr = mmap(NULL, THREAD_SIZE(stack_size), PROT_READ | PROT_WRITE,
+					 MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+	if (ptr == MAP_FAILED)
+		return NULL;
 
-	CHECK((ptr == MAP_FAILED) ? -1 : 0);
+	/* The guard page */
+	if (mprotect(ptr + THREAD_TCB_SIZE, THREAD_GUARD_SIZE, PROT_NONE) != 0)
+	{
+		CHECK(munmap(ptr, THREAD_SIZE(stack_size)));
+		return NULL;
+	}
 
 	return ptr;
 }
-#else
-/*
-  Use malloc to allocate a thread. This is probably faster than  mmap, but
-  cannot be made easily to 'detect' stack overflow.
- */
-void free_thread(void *ptr, size_t size) { free(ptr); }
 
-void *allocate_thread(size_t size)
+static void free_thread(void *ptr, size_t stack_size)
 {
-	void *ptr = aligned_alloc(SYSTEM_PAGE_SIZE, size);
-	CHECK((ptr == NULL) ? -1 : 0);
-	return ptr;
+	CHECK(munmap(ptr, THREAD_SIZE(stack_size)));
 }
-#endif
 
 /*
   This is the function that is used to start normal threads.
@@ -141,14 +147,110 @@ static void thread_start()
 	assert(0);
 }
 
+/*
+  The thread cache.
+
+  Released threads are kept for reuse, so that thread creation and exit
+  do not go through the allocator. Each core has a magazine of free
+  threads, accessed in the non-preemptive domain without locking. When
+  the magazine runs dry or overflows, half a magazine is exchanged with
+  the global depot, which keeps at most THREAD_CACHE_MAX free threads.
+  Only threads with the default stack size are cached.
+*/
+
+static rlnode thread_depot;				 /* Free threads, linked by sched_node */
+static unsigned int thread_depot_count = 0; /* The length of thread_depot */
+static Mutex thread_depot_spinlock = MUTEX_INIT;
+
+/* Get a free thread from the cache, or allocate a new one */
+static TCB *thread_cache_get()
+{
+	int preempt = preempt_off;
+	CCB *core = &CURCORE;
+
+	/* Refill half a magazine from the depot */
+	if (core->thread_magazine_count == 0 && thread_depot_count > 0)
+	{
+		Mutex_Lock(&thread_depot_spinlock);
+		while (core->thread_magazine_count < THREAD_MAGAZINE_SIZE / 2 && thread_depot_count > 0)
+		{
+			core->thread_magazine[core->thread_magazine_count++] = rlist_pop_front(&thread_depot)->tcb;
+			thread_depot_count--;
+		}
+		Mutex_Unlock(&thread_depot_spinlock);
+	}
+
+	TCB *tcb = NULL;
+	if (core->thread_magazine_count > 0)
+		tcb = core->thread_magazine[--core->thread_magazine_count];
+
+	if (preempt)
+		preempt_on;
+
+	if (tcb == NULL)
+		tcb = (TCB *)allocate_thread(THREAD_STACK_SIZE);
+
+	return tcb;
+}
+
+/* Return a released thread to the cache, or to the allocator */
+static void thread_cache_put(TCB *tcb)
+{
+	int preempt = preempt_off;
+	CCB *core = &CURCORE;
+
+	/* Flush half a magazine to the depot, and free what does not fit */
+	if (core->thread_magazine_count == THREAD_MAGAZINE_SIZE)
+	{
+		rlnode excess;
+		rlnode_init(&excess, NULL);
+
+		Mutex_Lock(&thread_depot_spinlock);
+		while (core->thread_magazine_count > THREAD_MAGAZINE_SIZE / 2)
+		{
+			TCB *t = core->thread_magazine[--core->thread_magazine_count];
+			rlnode_init(&t->sched_node, t);
+			if (thread_depot_count < THREAD_CACHE_MAX)
+			{
+				rlist_push_front(&thread_depot, &t->sched_node);
+				thread_depot_count++;
+			}
+			else
+				rlist_push_front(&excess, &t->sched_node);
+		}
+		Mutex_Unlock(&thread_depot_spinlock);
+
+		while (!is_rlist_empty(&excess))
+			free_thread(rlist_pop_front(&excess)->tcb, THREAD_STACK_SIZE);
+	}
+
+	core->thread_magazine[core->thread_magazine_count++] = tcb;
+
+	if (preempt)
+		preempt_on;
+}
+
 /*
   Initialize and return a new TCB
 */
 
 TCB *spawn_thread(PCB *pcb, void (*func)())
 {
-	/* The allocated thread size must be a multiple of page size */
-	TCB *tcb = (TCB *)allocate_thread(THREAD_SIZE);
+	TCB *tcb = spawn_thread_stack(pcb, func, THREAD_STACK_SIZE);
+	if (tcb == NULL)
+		FATAL("Cannot allocate a thread");
+	return tcb;
+}
+
+TCB *spawn_thread_stack(PCB *pcb, void (*func)(), unsigned int stack_size)
+{
+	/* The stack size must be a multiple of page size */
+	size_t ss = (stack_size < THREAD_STACK_MIN) ? THREAD_STACK_MIN : stack_size;
+	ss = ((ss + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE;
+
+	TCB *tcb = (ss == THREAD_STACK_SIZE) ? thread_cache_get() : (TCB *)allocate_thread(ss);
+	if (tcb == NULL)
+		return NULL;
 
 	/* Set the owner */
 	tcb->owner_pcb = pcb;
@@ -159,6 +261,7 @@ TCB *spawn_thread(PCB *pcb, void (*func)())
 	tcb->phase = CTX_CLEAN;
 	tcb->thread_func = func;
 	tcb->wakeup_time = NO_TIMEOUT;
+	tcb->state_spinlock = MUTEX_INIT;
 	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
 
 	tcb->its = QUANTUM;
@@ -170,25 +273,26 @@ TCB *spawn_thread(PCB *pcb, void (*func)())
 	tcb->priority = PRIORITY_QUEUES - 1;
 
 	/* Compute the stack segment address and size */
-	void *sp = ((void *)tcb) + THREAD_TCB_SIZE;
+	void *sp = ((void *)tcb) + THREAD_TCB_SIZE + THREAD_GUARD_SIZE;
+	tcb->stack_size = ss;
 
 	/* Init the context */
-	cpu_initialize_context(&tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+	cpu_initialize_context(&tcb->context, sp, ss, thread_start);
 
 #ifndef NVALGRIND
-	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + THREAD_STACK_SIZE);
+	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + ss);
 #endif
 
 	/* increase the count of active threads */
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads++;
-	Mutex_Unlock(&active_threads_spinlock);
+	__atomic_fetch_add(&active_threads, 1, __ATOMIC_RELAXED);
 
 	return tcb;
 }
 
 /*
-  This is called with sched_spinlock locked !
+  This is called from gain(), after the TCB has been switched out for
+  the last time. No scheduler lock may be held, as the TCB's own
+  state_spinlock is freed with it.
  */
 void release_TCB(TCB *tcb)
 {
@@ -196,11 +300,12 @@ void release_TCB(TCB *tcb)
 	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
 #endif
 
-	free_thread(tcb, THREAD_SIZE);
+	if (tcb->stack_size == THREAD_STACK_SIZE)
+		thread_cache_put(tcb);
+	else
+		free_thread(tcb, tcb->stack_size);
 
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads--;
-	Mutex_Unlock(&active_threads_spinlock);
+	__atomic_fetch_sub(&active_threads, 1, __ATOMIC_RELAXED);
 }
 
 /*
@@ -214,19 +319,26 @@ void release_TCB(TCB *tcb)
  */
 
 /*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
+  Each core owns PRIORITY_QUEUES ready queues (see CCB), protected by
+  the core's sched_spinlock. A thread that becomes ready is queued at
+  the core that made it ready; a core that finds its own queues empty
+  steals from the busiest sibling.
+
+  The state of a thread (state, phase and wakeup_time) is protected by
+  the thread's own state_spinlock.
 
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
+  Also, the scheduler contains a timing wheel of all the sleeping
+  threads with a timeout, protected by timeout_spinlock.
 
-  Both of these structures are protected by @c sched_spinlock.
+  Lock order: TCB state_spinlock, then timeout_spinlock, then a core's
+  sched_spinlock. The timeout scan, which holds timeout_spinlock, only
+  tries to lock a TCB and retries it later on failure.
 */
 
-rlnode SCHED[PRIORITY_QUEUES];	   /* The scheduler queue */
-rlnode TIMEOUT_LIST;			   /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
-int count = 0;	/* the counter we use to boost threads */
+Mutex timeout_spinlock = MUTEX_INIT; /* spinlock for the timeout wheel */
+
+/* The earliest time the timeout wheel needs a scan, read without the lock */
+static volatile TimerDuration timeout_earliest = NO_TIMEOUT;
 
 /* Interrupt handler for ALARM */
 void yield_handler() { yield(SCHED_QUANTUM); }
@@ -237,60 +349,248 @@ void ici_handler()
 }
 
 /*
-  Possibly add TCB to the scheduler timeout list.
+  The timeout wheel.
+
+  Threads sleeping with a timeout are kept in a hierarchical timing
+  wheel of WHEEL_LEVELS levels with WHEEL_SLOTS slots each. Time is
+  counted in ticks of 2^WHEEL_TICK_SHIFT usec, and a thread expires
+  at the first tick not earlier than its wakeup_time.
+
+  Level k holds the threads that expire less than WHEEL_SLOTS^(k+1)
+  ticks after 'now', in the slot given by bits [k*WHEEL_BITS, (k+1)*WHEEL_BITS)
+  of their expiry tick. Whenever the bits of 'now' below level k wrap
+  to zero, the current slot of level k is cascaded to the levels below.
+  Thus, insertion and removal are O(1), and each thread is cascaded at
+  most WHEEL_LEVELS-1 times. Threads beyond the range of the wheel
+  are parked in the last slot of the top level and re-inserted when
+  it is cascaded.
+*/
+#define WHEEL_TICK_SHIFT 10	/* a tick is 1024 usec */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+static struct
+{
+	rlnode slot[WHEEL_LEVELS][WHEEL_SLOTS];
+	uint64_t occupied[WHEEL_LEVELS]; /* bit i is set iff slot[level][i] is non-empty */
+	rlnode retry;					 /* expired threads whose state_spinlock was busy */
+	uint64_t now;					 /* the next tick to process */
+} WHEEL;
+
+/* The expiry tick of a wakeup time, rounded up */
+static inline uint64_t wheel_tick(TimerDuration t)
+{
+	return (t + (1ull << WHEEL_TICK_SHIFT) - 1) >> WHEEL_TICK_SHIFT;
+}
+
+/*
+  Add a thread to the wheel, according to its wakeup_time.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void wheel_insert(TCB *tcb)
+{
+	uint64_t expires = wheel_tick(tcb->wakeup_time);
+	if (expires < WHEEL.now)
+		expires = WHEEL.now;
+
+	/* Park threads beyond the range of the wheel */
+	const uint64_t range = 1ull << (WHEEL_BITS * WHEEL_LEVELS);
+	if (expires - WHEEL.now >= range)
+		expires = WHEEL.now + range - 1;
+
+	uint64_t delta = expires - WHEEL.now;
+	int level = 0;
+	while (delta >= (1ull << (WHEEL_BITS * (level + 1))))
+		level++;
+
+	unsigned int i = (expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+	rlist_push_back(&WHEEL.slot[level][i], &tcb->sched_node);
+	WHEEL.occupied[level] |= 1ull << i;
+
+	TimerDuration when = expires << WHEEL_TICK_SHIFT;
+	if (when < timeout_earliest)
+		timeout_earliest = when;
+}
+
+/*
+  Remove a thread from the wheel (or the retry list).
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void wheel_remove(TCB *tcb)
+{
+	rlnode *head = tcb->sched_node.prev;
+
+	/* If the thread is alone in a wheel slot, the slot becomes empty */
+	if (head == tcb->sched_node.next)
+	{
+		long pos = head - &WHEEL.slot[0][0];
+		if (pos >= 0 && pos < WHEEL_LEVELS * WHEEL_SLOTS)
+			WHEEL.occupied[pos / WHEEL_SLOTS] &= ~(1ull << (pos % WHEEL_SLOTS));
+	}
+
+	rlist_remove(&tcb->sched_node);
+}
+
+/*
+  Wake up an expired thread. If its state_spinlock is busy, the thread
+  is moved to the retry list instead.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void sched_mark_ready(TCB *tcb);
+static void wheel_expire(TCB *tcb)
+{
+	if (Mutex_TryLock(&tcb->state_spinlock))
+	{
+		tcb->wakeup_time = NO_TIMEOUT;
+		sched_mark_ready(tcb);
+		Mutex_Unlock(&tcb->state_spinlock);
+	}
+	else
+		rlist_push_back(&WHEEL.retry, &tcb->sched_node);
+}
+
+/*
+  Process all the ticks of the wheel up to (and including) tick 'upto'.
+  Ticks with nothing to expire or cascade are skipped.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void wheel_advance(uint64_t upto)
+{
+	while (WHEEL.now <= upto)
+	{
+		uint64_t now = WHEEL.now;
+		unsigned int i = now & (WHEEL_SLOTS - 1);
+
+		if (i == 0)
+		{
+			/* Cascade the current slot of each level whose lower bits wrapped */
+			for (int level = 1; level < WHEEL_LEVELS; level++)
+			{
+				unsigned int j = (now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+				rlnode *slot = &WHEEL.slot[level][j];
+				WHEEL.occupied[level] &= ~(1ull << j);
+				while (!is_rlist_empty(slot))
+					wheel_insert(rlist_pop_front(slot)->tcb);
+				if (j != 0)
+					break;
+			}
+		}
+		else
+		{
+			/* Skip to the next occupied slot of level 0, or the next cascade */
+			uint64_t ahead = WHEEL.occupied[0] >> i;
+			uint64_t next = ahead ? now + __builtin_ctzll(ahead) : (now | (WHEEL_SLOTS - 1)) + 1;
+			if (next != now)
+			{
+				WHEEL.now = (next > upto) ? upto + 1 : next;
+				continue;
+			}
+		}
+
+		/* Expire the current slot of level 0 */
+		rlnode *slot = &WHEEL.slot[0][i];
+		WHEEL.occupied[0] &= ~(1ull << i);
+		while (!is_rlist_empty(slot))
+			wheel_expire(rlist_pop_front(slot)->tcb);
+
+		WHEEL.now = now + 1;
+	}
+}
+
+/*
+  Recompute timeout_earliest: the next tick that has something to
+  expire or cascade.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void wheel_refresh()
+{
+	int empty = 1;
+	for (int level = 0; level < WHEEL_LEVELS; level++)
+		if (WHEEL.occupied[level])
+			empty = 0;
+
+	if (!is_rlist_empty(&WHEEL.retry))
+		timeout_earliest = 0;
+	else if (empty)
+		timeout_earliest = NO_TIMEOUT;
+	else
+	{
+		uint64_t now = WHEEL.now;
+		uint64_t ahead = WHEEL.occupied[0] >> (now & (WHEEL_SLOTS - 1));
+		uint64_t next = ahead ? now + __builtin_ctzll(ahead) : (now | (WHEEL_SLOTS - 1)) + 1;
+		timeout_earliest = next << WHEEL_TICK_SHIFT;
+	}
+}
+
+/*
+  Possibly add TCB to the scheduler timeout wheel.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
 */
 static void sched_register_timeout(TCB *tcb, TimerDuration timeout)
 {
 	if (timeout != NO_TIMEOUT)
 	{
+		Mutex_Lock(&timeout_spinlock);
+
 		/* set the wakeup time */
 		TimerDuration curtime = bios_clock();
-		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
-
-		/* add to the TIMEOUT_LIST in sorted order */
-		rlnode *n = TIMEOUT_LIST.next;
-		for (; n != &TIMEOUT_LIST; n = n->next)
-			/* skip earlier entries */
-			if (tcb->wakeup_time < n->tcb->wakeup_time)
-				break;
-		/* insert before n */
-		rl_splice(n->prev, &tcb->sched_node);
+		tcb->wakeup_time = curtime + timeout;
+
+		/* An empty wheel is not advanced, so bring it up to date */
+		if (timeout_earliest == NO_TIMEOUT && WHEEL.now < (curtime >> WHEEL_TICK_SHIFT))
+			WHEEL.now = curtime >> WHEEL_TICK_SHIFT;
+
+		wheel_insert(tcb);
+
+		Mutex_Unlock(&timeout_spinlock);
 	}
 }
 
+/* ready_mask must hold one bit per priority level */
+_Static_assert(PRIORITY_QUEUES <= 32, "PRIORITY_QUEUES must fit in ready_mask");
+
+/* The ready queue of priority level 'level' at a core */
+static inline rlnode *sched_level(CCB *core, int level)
+{
+	return &core->ready_queue[(level + core->queue_base) % PRIORITY_QUEUES];
+}
+
 /*
-  Add TCB to the end of the scheduler list.
+  Add TCB to the end of the current core's ready queue of its priority.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
 */
 static void sched_queue_add(TCB *tcb)
 {
-	/* Insert at the end of the scheduling list */
-	rlist_push_back(&SCHED[tcb->priority], &tcb->sched_node); // Insert tcb at the end of the queue with its current priority
+	CCB *core = &CURCORE;
+
+	Mutex_Lock(&core->sched_spinlock);
+	rlist_push_back(sched_level(core, tcb->priority), &tcb->sched_node);
+	core->ready_mask |= 1u << tcb->priority;
+	core->ready_count++;
+	Mutex_Unlock(&core->sched_spinlock);
 
 	/* Restart possibly halted cores */
 	cpu_core_restart_one();
 }
 
 /*
-	Adjust the state of a thread to make it READY.
+	Mark a thread READY and possibly add it to the ready queue.
+	The thread must not be in the timeout wheel.
 
-	*** MUST BE CALLED WITH sched_spinlock HELD ***
+	*** MUST BE CALLED WITH tcb->state_spinlock HELD ***
  */
-static void sched_make_ready(TCB *tcb)
+static void sched_mark_ready(TCB *tcb)
 {
 	assert(tcb->state == STOPPED || tcb->state == INIT);
-
-	/* Possibly remove from TIMEOUT_LIST */
-	if (tcb->wakeup_time != NO_TIMEOUT)
-	{
-		/* tcb is in TIMEOUT_LIST, fix it */
-		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
-		rlist_remove(&tcb->sched_node);
-		tcb->wakeup_time = NO_TIMEOUT;
-	}
+	assert(tcb->wakeup_time == NO_TIMEOUT);
 
 	/* Mark as ready */
 	tcb->state = READY;
@@ -301,66 +601,163 @@ static void sched_make_ready(TCB *tcb)
 }
 
 /*
-  Scan the \c TIMEOUT_LIST for threads whose timeout has expired, and
-  wake them up.
+	Adjust the state of a thread to make it READY.
+
+	*** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+ */
+static void sched_make_ready(TCB *tcb)
+{
+	/* Possibly remove from the timeout wheel */
+	if (tcb->wakeup_time != NO_TIMEOUT)
+	{
+		/* tcb is in the timeout wheel, fix it */
+		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
+		Mutex_Lock(&timeout_spinlock);
+		wheel_remove(tcb);
+		tcb->wakeup_time = NO_TIMEOUT;
+		Mutex_Unlock(&timeout_spinlock);
+	}
+
+	sched_mark_ready(tcb);
+}
+
+/*
+  Advance the timeout wheel to the current time, and wake up the
+  threads whose timeout has expired.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  A thread whose state_spinlock is busy is kept in a retry list; whoever
+  holds it is about to wake it up anyway, or it will be woken up by
+  a later scan.
 */
 static void sched_wakeup_expired_timeouts()
 {
-	/* Empty the timeout list up to the current time and wake up each thread */
 	TimerDuration curtime = bios_clock();
 
-	while (!is_rlist_empty(&TIMEOUT_LIST))
-	{
-		TCB *tcb = TIMEOUT_LIST.next->tcb;
-		if (tcb->wakeup_time > curtime)
-			break;
-		sched_make_ready(tcb);
-	}
+	/* Avoid the lock when nothing can have expired */
+	if (timeout_earliest > curtime)
+		return;
+
+	Mutex_Lock(&timeout_spinlock);
+
+	/* First, retry the threads we failed to wake up before */
+	rlnode retry;
+	rlnode_init(&retry, NULL);
+	rlist_append(&retry, &WHEEL.retry);
+	while (!is_rlist_empty(&retry))
+		wheel_expire(rlist_pop_front(&retry)->tcb);
+
+	wheel_advance(curtime >> WHEEL_TICK_SHIFT);
+	wheel_refresh();
+
+	Mutex_Unlock(&timeout_spinlock);
 }
 
 /*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
+  Remove the head of the highest non-empty ready queue of a core and
+  return it. Return NULL if all queues are empty. The thread's
+  priority is set to the level it was taken from, as boosts do not
+  update queued threads.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
 */
-static TCB *sched_queue_select(TCB *current)
+static TCB *sched_queue_pop(CCB *core)
+{
+	if (core->ready_mask == 0)
+		return NULL;
+
+	/* The highest set bit of ready_mask */
+	int level = 31 - __builtin_clz(core->ready_mask);
+	rlnode *queue = sched_level(core, level);
+
+	TCB *tcb = rlist_pop_front(queue)->tcb;
+	if (is_rlist_empty(queue))
+		core->ready_mask &= ~(1u << level);
+	core->ready_count--;
+
+	tcb->priority = level;
+	return tcb;
+}
+
+/*
+  Steal a thread from the sibling core with the most queued threads.
+  Return NULL if no sibling has any.
+*/
+static TCB *sched_queue_steal(CCB *thief)
 {
-	int i = PRIORITY_QUEUES - 1;
-	/* Searching in queues until we find a non empty one */
-	while (i >= 0)
+	CCB *victim = NULL;
+	unsigned int most = 0;
+
+	/* The counts are read without locking; they are only a hint */
+	for (uint c = 0; c < cpu_cores(); c++)
 	{
-		if (is_rlist_empty(&SCHED[i]))
-		{
-			i--;
-		}
-		else //found it!
+		if (&cctx[c] != thief && cctx[c].ready_count > most)
 		{
-			break;
+			most = cctx[c].ready_count;
+			victim = &cctx[c];
 		}
 	}
 
-	/* Get the head of the SCHED list */
-	rlnode *sel = NULL;
+	if (victim == NULL)
+		return NULL;
 
-	if (i >= 0)
-	 sel = rlist_pop_front(&SCHED[i]);
+	Mutex_Lock(&victim->sched_spinlock);
+	TCB *tcb = sched_queue_pop(victim);
+	Mutex_Unlock(&victim->sched_spinlock);
 
-	TCB *next_thread = NULL;
+	return tcb;
+}
 
-	if (sel != NULL)
-	 next_thread = sel->tcb; /* When the list is empty, this is NULL */
+/*
+  Select the next thread to run on this core: the head of the local
+  ready queues or, when the core would otherwise go idle, a thread
+  stolen from a sibling.
+*/
+static TCB *sched_queue_select(TCB *current)
+{
+	CCB *core = &CURCORE;
+
+	Mutex_Lock(&core->sched_spinlock);
+	TCB *next_thread = sched_queue_pop(core);
+	Mutex_Unlock(&core->sched_spinlock);
+
+	int current_ready = (current->state == READY && current->type != IDLE_THREAD);
+
+	if (next_thread == NULL && !current_ready)
+		next_thread = sched_queue_steal(core);
 
 	if (next_thread == NULL)
-		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
+		next_thread = current_ready ? current : &core->idle_thread;
 
 	next_thread->its = QUANTUM;
 
 	return next_thread;
 }
 
+/*
+  Boost every thread queued at this core by one priority level.
+
+  Instead of moving every thread, the levels are rotated by one over
+  ready_queue: level L becomes level L+1, and the old top level, which
+  would wrap around to level 0, is moved in front of the new top level
+  with a single splice.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static void sched_queue_boost(CCB *core)
+{
+	const unsigned int top = 1u << (PRIORITY_QUEUES - 1);
+	rlnode *oldtop = sched_level(core, PRIORITY_QUEUES - 1);
+
+	/* Rotate: the old level L is now level L+1 */
+	core->queue_base = (core->queue_base + PRIORITY_QUEUES - 1) % PRIORITY_QUEUES;
+
+	/* The old top queue is now level 0; merge it ahead of the new top */
+	rlist_prepend(sched_level(core, PRIORITY_QUEUES - 1), oldtop);
+
+	unsigned int mask = core->ready_mask;
+	core->ready_mask = ((mask << 1) & (top | (top - 1))) | (mask & top);
+}
+
 /*
   Make the process ready.
  */
@@ -371,8 +768,8 @@ int wakeup(TCB *tcb)
 	/* Preemption off */
 	int oldpre = preempt_off;
 
-	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(&sched_spinlock);
+	/* To touch tcb->state, we must get the thread's spinlock. */
+	Mutex_Lock(&tcb->state_spinlock);
 
 	if (tcb->state == STOPPED || tcb->state == INIT)
 	{
@@ -380,7 +777,7 @@ int wakeup(TCB *tcb)
 		ret = 1;
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	Mutex_Unlock(&tcb->state_spinlock);
 
 	/* Restore preemption state */
 	if (oldpre)
@@ -399,7 +796,7 @@ void sleep_releasing(Thread_state state, Mutex *mx, enum SCHED_CAUSE cause,
 
 	int preempt = preempt_off;
 	TCB *tcb = CURTHREAD;
-	Mutex_Lock(&sched_spinlock);
+	Mutex_Lock(&tcb->state_spinlock);
 
 	/* mark the thread as stopped or exited */
 	tcb->state = state;
@@ -408,13 +805,15 @@ void sleep_releasing(Thread_state state, Mutex *mx, enum SCHED_CAUSE cause,
 	if (state != EXITED)
 		sched_register_timeout(tcb, timeout);
 
-	/* Release mx */
+	Mutex_Unlock(&tcb->state_spinlock);
+
+	/* 
+	   Release mx. The state is already changed, so a wakeup() that
+	   follows the release will find this thread STOPPED.
+	 */
 	if (mx != NULL)
 		Mutex_Unlock(mx);
 
-	/* Release the schduler spinlock before calling yield() !!! */
-	Mutex_Unlock(&sched_spinlock);
-
 	/* call this to schedule someone else */
 	yield(cause);
 
@@ -433,39 +832,25 @@ void yield(enum SCHED_CAUSE cause)
 	/* We must stop preemption but save it! */
 	int preempt = preempt_off;
 
-	TCB *current = CURTHREAD; /* Make a local copy of current process, for speed */
-
-	Mutex_Lock(&sched_spinlock);
+	CCB *core = &CURCORE;
+	TCB *current = core->current_thread; /* Make a local copy of current process, for speed */
 
-	/* After we MAX_CALLS calls of yield(), we boost every thread by 1 */
-	count++;
-	
-	/* Check if yield has been called MAX_CALLS times */
-	if (count == MAX_CALLS)	// we have reached MAX_CALLS
+	/* After MAX_CALLS calls of yield() on this core, we boost every thread queued here by 1 */
+	if (++core->yield_count == MAX_CALLS)
 	{
-		/*Increasing the priority of each queue one by one*/
-		rlnode *temp = NULL;	//temporary "queue" (node)
-
-		for (int i = PRIORITY_QUEUES - 2; i >= 0; i--)
-		{
-			/* Move threads from a lower priority queue to a higher one */
-			while (!is_rlist_empty(&SCHED[i])){
-
-						temp = rlist_pop_front(&SCHED[i]);
-						temp->tcb->priority++;
-						rlist_push_back(&SCHED[i+1], temp);
-			}
-			
-		}
+		Mutex_Lock(&core->sched_spinlock);
+		sched_queue_boost(core);
+		Mutex_Unlock(&core->sched_spinlock);
 
 		/* Reset the count after boosting priorities */
-		count = 0;
-		
+		core->yield_count = 0;
 	}
 
 	/* Update CURTHREAD state */
+	Mutex_Lock(&current->state_spinlock);
 	if (current->state == RUNNING)
 		current->state = READY;
+	Mutex_Unlock(&current->state_spinlock);
 
 	/* Update CURTHREAD scheduler data */
 	current->rts = remaining;
@@ -504,14 +889,12 @@ void yield(enum SCHED_CAUSE cause)
 	assert(next != NULL);
 
 	/* Save the current TCB for the gain phase */
-	CURCORE.previous_thread = current;
-
-	Mutex_Unlock(&sched_spinlock);
+	core->previous_thread = current;
 
 	/* Perform the context switch if the next thread is different */
 	if (current != next)
 	{
-		CURTHREAD = next;
+		core->current_thread = next;
 		cpu_swap_context(&current->context, &next->context);
 	}
 
@@ -535,19 +918,23 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {
-	Mutex_Lock(&sched_spinlock);
-
-	TCB *current = CURTHREAD;
+	CCB *core = &CURCORE;
+	TCB *current = core->current_thread;
 
 	/* Mark current state */
+	Mutex_Lock(&current->state_spinlock);
 	current->state = RUNNING;
 	current->phase = CTX_DIRTY;
 	current->rts = current->its;
+	Mutex_Unlock(&current->state_spinlock);
 
 	/* Take care of the previous thread */
-	TCB *prev = CURCORE.previous_thread;
+	TCB *prev = core->previous_thread;
 	if (current != prev)
 	{
+		int exited = 0;
+
+		Mutex_Lock(&prev->state_spinlock);
 		prev->phase = CTX_CLEAN;
 		switch (prev->state)
 		{
@@ -556,16 +943,19 @@ void gain(int preempt)
 				sched_queue_add(prev);
 			break;
 		case EXITED:
-			release_TCB(prev);
+			exited = 1;
 			break;
 		case STOPPED:
 			break;
 		default:
 			assert(0); /* prev->state should not be INIT or RUNNING ! */
 		}
-	}
+		Mutex_Unlock(&prev->state_spinlock);
 
-	Mutex_Unlock(&sched_spinlock);
+		/* The spinlock lives in the TCB, so release it unlocked */
+		if (exited)
+			release_TCB(prev);
+	}
 
 	/* Reset preemption as needed */
 	if (preempt)
@@ -597,11 +987,40 @@ static void idle_thread()
  */
 void initialize_scheduler()
 {
-	for (int i = 0; i < PRIORITY_QUEUES; i++)
+	for (int c = 0; c < MAX_CORES; c++)
 	{
-		rlnode_init(&SCHED[i], NULL);
+		for (int i = 0; i < PRIORITY_QUEUES; i++)
+			rlnode_init(&cctx[c].ready_queue[i], NULL);
+		cctx[c].ready_mask = 0;
+		cctx[c].queue_base = 0;
+		cctx[c].sched_spinlock = MUTEX_INIT;
+		cctx[c].ready_count = 0;
+		cctx[c].yield_count = 0;
+		cctx[c].thread_magazine_count = 0;
 	}
-	rlnode_init(&TIMEOUT_LIST, NULL);
+	for (int level = 0; level < WHEEL_LEVELS; level++)
+	{
+		for (int i = 0; i < WHEEL_SLOTS; i++)
+			rlnode_init(&WHEEL.slot[level][i], NULL);
+		WHEEL.occupied[level] = 0;
+	}
+	rlnode_init(&WHEEL.retry, NULL);
+	WHEEL.now = bios_clock() >> WHEEL_TICK_SHIFT;
+	timeout_earliest = NO_TIMEOUT;
+
+	rlnode_init(&thread_depot, NULL);
+	thread_depot_count = 0;
+}
+
+void finalize_scheduler()
+{
+	for (int c = 0; c < MAX_CORES; c++)
+		while (cctx[c].thread_magazine_count > 0)
+			free_thread(cctx[c].thread_magazine[--cctx[c].thread_magazine_count], THREAD_STACK_SIZE);
+
+	while (!is_rlist_empty(&thread_depot))
+		free_thread(rlist_pop_front(&thread_depot)->tcb, THREAD_STACK_SIZE);
+	thread_depot_count = 0;
 }
 
 void run_scheduler()
@@ -618,6 +1037,7 @@ void run_scheduler()
 	curcore->idle_thread.state = RUNNING;
 	curcore->idle_thread.phase = CTX_DIRTY;
 	curcore->idle_thread.wakeup_time = NO_TIMEOUT;
+	curcore->idle_thread.state_spinlock = MUTEX_INIT;
 	rlnode_init(&curcore->idle_thread.sched_node, &curcore->idle_thread);
 
 	curcore->idle_thread.its = QUANTUM;
@@ -115,6 +115,10 @@ typedef struct thread_control_block {
 
 	TimerDuration wakeup_time; /**< @brief The time this thread will be woken up by the scheduler */
 
+	Mutex state_spinlock; /**< @brief Protects @c state, @c phase and @c wakeup_time */
+
+	size_t stack_size; /**< @brief The size of the thread's stack */
+
 	rlnode sched_node; /**< @brief Node to use when queueing in the scheduler queue */
 	TimerDuration its; /**< @brief Initial time-slice for this thread */
 	TimerDuration rts; /**< @brief Remaining time-slice for this thread */
@@ -141,15 +145,55 @@ typedef struct thread_control_block {
  */
 #define THREAD_STACK_SIZE (128 * 1024)
 
+/** @brief Minimum thread stack size.
+
+  Smaller stack sizes requested for a thread are rounded up to this.
+ */
+#define THREAD_STACK_MIN (16 * 1024)
+
 /************************
  *
  *      Scheduler
  *
  ************************/
 
+/** @brief Number of MLFQ priority levels.
+
+  Level @c PRIORITY_QUEUES-1 is the highest priority.
+ */
+#define PRIORITY_QUEUES 10
+
+/** @brief Size of the per-core magazines of free threads.
+
+  Each core keeps up to this many released threads (TCB and stack) for
+  reuse. May be overridden at compile time.
+ */
+#ifndef THREAD_MAGAZINE_SIZE
+#define THREAD_MAGAZINE_SIZE 16
+#endif
+
+/** @brief Maximum number of free threads kept in the global depot.
+
+  Released threads that do not fit in a core magazine or the depot are
+  returned to the allocator. May be overridden at compile time.
+ */
+#ifndef THREAD_CACHE_MAX
+#define THREAD_CACHE_MAX 256
+#endif
+
 /** @brief Core control block.
 
   Per-core info in memory (basically scheduler-related). 
+
+  Each core owns a set of MLFQ ready queues, protected by its own
+  @c sched_spinlock. Threads made ready on a core are queued locally,
+  and a core that runs out of ready threads steals from the busiest
+  sibling.
+
+  Priority level @c L is kept in @c ready_queue[(L+queue_base) % PRIORITY_QUEUES],
+  and bit @c L of @c ready_mask is set iff that queue is non-empty. A
+  priority boost only rotates @c queue_base, so the priority of a queued
+  thread is its queue, and @c TCB.priority is refreshed when it is dequeued.
  */
 typedef struct core_control_block {
 	uint id; /**< @brief The core id */
@@ -158,6 +202,16 @@ typedef struct core_control_block {
 	TCB* previous_thread; /**< @brief Points to the thread that previously owned the core */
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
 
+	rlnode ready_queue[PRIORITY_QUEUES]; /**< @brief The MLFQ ready queues of this core */
+	unsigned int ready_mask; /**< @brief Bit @c L is set iff priority level @c L is non-empty */
+	unsigned int queue_base; /**< @brief Rotation of priority levels over @c ready_queue */
+	Mutex sched_spinlock; /**< @brief Protects the ready queues and their counters */
+	volatile unsigned int ready_count; /**< @brief Number of queued threads, read unlocked by thieves */
+	unsigned int yield_count; /**< @brief Calls to @c yield() since the last priority boost */
+
+	TCB* thread_magazine[THREAD_MAGAZINE_SIZE]; /**< @brief Free threads cached by this core */
+	unsigned int thread_magazine_count; /**< @brief Number of threads in @c thread_magazine */
+
 } CCB;
 
 /** @brief the array of Core Control Blocks (CCB) for the kernel */
@@ -207,6 +261,18 @@ TCB* cur_thread();
 */
 TCB* spawn_thread(PCB* pcb, void (*func)());
 
+/**
+  @brief Create a new thread with a given stack size.
+
+  This is like @ref spawn_thread, but the new thread gets a stack of
+  (at least) @c stack_size bytes, instead of @c THREAD_STACK_SIZE.
+  The size is rounded up to a multiple of the page size, and to at
+  least @c THREAD_STACK_MIN.
+
+  @returns the new TCB, or NULL if the thread memory could not be allocated.
+*/
+TCB* spawn_thread_stack(PCB* pcb, void (*func)(), unsigned int stack_size);
+
 /**
   @brief Wakeup a blocked thread.
 
@@ -276,6 +342,14 @@ void run_scheduler(void);
  */
 void initialize_scheduler(void);
 
+/**
+  @brief Finalize the scheduler.
+
+  This function is called after the scheduler has stopped on all cores,
+  to return the cached free threads to the allocator.
+ */
+void finalize_scheduler(void);
+
 /**
   @brief Quantum (in microseconds) 
 
@@ -6,6 +6,110 @@
 #include "kernel_proc.h"
 #include "kernel_cc.h"
 
+/* 
+	Protects PORT_MAP and the rings of listeners. It is locked before 
+	any socket. PORT_MAP[port] is one of the listeners of the port, the 
+	first one that Connect considers.
+ */
+static Mutex port_map_lock = MUTEX_INIT;
+
+/*
+	The socket cache. Freed sockets are kept for reuse, up to 
+	SOCKET_CACHE_MAX, so that connections do not go through the allocator.
+ */
+
+/* Free sockets, linked by unbound_s.unbound_socket */
+static rlnode socket_cache = { .obj = NULL, .prev = &socket_cache, .next = &socket_cache };
+static unsigned int socket_cache_count = 0; /* The length of socket_cache */
+static Mutex socket_cache_lock = MUTEX_INIT;
+
+/* Get a free socket from the cache, or allocate a new one */
+static socket_cb* socket_cache_get()
+{
+	socket_cb* socketcb = NULL;
+
+	Mutex_Lock(&socket_cache_lock);
+	if (socket_cache_count > 0) {
+		socketcb = rlist_pop_front(&socket_cache)->obj;
+		socket_cache_count--;
+	}
+	Mutex_Unlock(&socket_cache_lock);
+
+	if (socketcb == NULL)
+		socketcb = (socket_cb*) xmalloc(sizeof(socket_cb)); // Terminates on failure
+	return socketcb;
+}
+
+/* Return a freed socket to the cache, or to the allocator */
+static void socket_cache_put(socket_cb* socketcb)
+{
+	Mutex_Lock(&socket_cache_lock);
+	if (socket_cache_count < SOCKET_CACHE_MAX) {
+		socket_cache_count++;
+		rlnode_init(&socketcb->unbound_s.unbound_socket, socketcb);
+		rlist_push_front(&socket_cache, &socketcb->unbound_s.unbound_socket);
+		socketcb = NULL;
+	}
+	Mutex_Unlock(&socket_cache_lock);
+
+	free(socketcb);
+}
+
+/*
+	Drop a reference to a socket. The socket must be locked, and is
+	unlocked by this call. It is freed when the last reference is dropped.
+ */
+static void socket_decref(socket_cb* socketcb)
+{
+	int last = (--socketcb->refcount == 0);
+	Mutex_Unlock(&socketcb->lock);
+
+	if (last) {
+		if (socketcb->type == SOCKET_LISTENER)
+			poll_detach(&socketcb->listener_s.pollers);
+		socket_cache_put(socketcb);
+	}
+}
+
+/*
+	Get the read (or write) pipe of a peer socket for an operation, or 
+	NULL. The pipe stays open until the matching put_pipe().
+ */
+static PIPE_CB* get_pipe(socket_cb* socketcb, int write)
+{
+	Mutex_Lock(&socketcb->lock);
+	PIPE_CB* pipe = NULL;
+	if (socketcb->type == SOCKET_PEER) {
+		pipe = write ? socketcb->peer_s.write_pipe : socketcb->peer_s.read_pipe;
+		if (pipe != NULL) {
+			if (write) socketcb->peer_s.write_users++;
+			else socketcb->peer_s.read_users++;
+		}
+	}
+	Mutex_Unlock(&socketcb->lock);
+	return pipe;
+}
+
+/* End an operation on a pipe. The last user closes a pipe that was shut down. */
+static void put_pipe(socket_cb* socketcb, int write)
+{
+	Mutex_Lock(&socketcb->lock);
+	peer_socket* p = &socketcb->peer_s;
+	if (write) {
+		if (--p->write_users == 0 && p->write_shut != NULL) {
+			pipe_writer_close(p->write_shut);
+			p->write_shut = NULL;
+		}
+	}
+	else {
+		if (--p->read_users == 0 && p->read_shut != NULL) {
+			pipe_reader_close(p->read_shut);
+			p->read_shut = NULL;
+		}
+	}
+	Mutex_Unlock(&socketcb->lock);
+}
+
 int socket_read(void *socket_cb_t, char *buf, unsigned int n) {
 	
 	if (socket_cb_t == NULL)
@@ -13,11 +117,62 @@ int socket_read(void *socket_cb_t, char *buf, unsigned int n) {
 
 	socket_cb* socketcb = (socket_cb*) socket_cb_t;
 
-	// Ensure the socket is a peer and has a valid read pipe before reading
-	if (socketcb->type != SOCKET_PEER || socketcb->peer_s.read_pipe == NULL)
+	// The pipe stays open while we use it, even if the socket is shut down
+	PIPE_CB* pipe = get_pipe(socketcb, 0);
+
+	if (pipe == NULL)
+		return -1;
+	
+	int ret = pipe_read(pipe, buf, n);
+	put_pipe(socketcb, 0);
+	return ret;
+}
+
+int socket_splice(void *socket_cb_t, int (*write)(void*, const char*, unsigned int), 
+	void* out, unsigned int n) {
+	
+	if (socket_cb_t == NULL)
+		return -1;
+
+	socket_cb* socketcb = (socket_cb*) socket_cb_t;
+
+	PIPE_CB* pipe = get_pipe(socketcb, 0);
+
+	if (pipe == NULL)
+		return -1;
+
+	// Nobody could drain a pipe that is spliced into itself, through the peer
+	if (write == socket_write) {
+		socket_cb* outcb = (socket_cb*) out;
+		Mutex_Lock(&outcb->lock);
+		int loop = (outcb->type == SOCKET_PEER && outcb->peer_s.write_pipe == pipe);
+		Mutex_Unlock(&outcb->lock);
+		if (loop) {
+			put_pipe(socketcb, 0);
+			return -1;
+		}
+	}
+	
+	int ret = pipe_splice(pipe, write, out, n);
+	put_pipe(socketcb, 0);
+	return ret;
+}
+
+int socket_readv(void *socket_cb_t, const iovec_t* iov, unsigned int iovcnt) {
+	
+	if (socket_cb_t == NULL)
+		return -1;
+
+	socket_cb* socketcb = (socket_cb*) socket_cb_t;
+
+	PIPE_CB* pipe = get_pipe(socketcb, 0);
+
+	if (pipe == NULL)
 		return -1;
 	
-	return pipe_read(socketcb->peer_s.read_pipe, buf, n);
+	int ret = pipe_readv(pipe, iov, iovcnt);
+	put_pipe(socketcb, 0);
+	return ret;
 }
 
 int socket_write(void *socket_cb_t, const char *buf, unsigned int n) {
@@ -27,10 +182,31 @@ int socket_write(void *socket_cb_t, const char *buf, unsigned int n) {
 
 	socket_cb* socketcb = (socket_cb*) socket_cb_t;
 
-	if (socketcb->peer_s.write_pipe == NULL || socketcb->type != SOCKET_PEER)
+	PIPE_CB* pipe = get_pipe(socketcb, 1);
+
+	if (pipe == NULL)
 		return -1;
 
-	return pipe_write(socketcb->peer_s.write_pipe, buf, n);
+	int ret = pipe_write(pipe, buf, n);
+	put_pipe(socketcb, 1);
+	return ret;
+}
+
+int socket_writev(void *socket_cb_t, const iovec_t* iov, unsigned int iovcnt) {
+	
+	if (socket_cb_t == NULL)
+		return -1;
+
+	socket_cb* socketcb = (socket_cb*) socket_cb_t;
+
+	PIPE_CB* pipe = get_pipe(socketcb, 1);
+
+	if (pipe == NULL)
+		return -1;
+
+	int ret = pipe_writev(pipe, iov, iovcnt);
+	put_pipe(socketcb, 1);
+	return ret;
 }
 
 
@@ -41,270 +217,449 @@ int socket_close(void *socket_cb_t) {
 	
 	socket_cb* socketcb = (socket_cb*) socket_cb_t;
 
+	// Once the fcb is gone, the type of the socket cannot change
+	Mutex_Lock(&socketcb->lock);
+	socketcb->fcb = NULL;
+	socket_type type = socketcb->type;
+	Mutex_Unlock(&socketcb->lock);
+
 	// Handle listener socket type
-	if (socketcb->type == SOCKET_LISTENER) {
+	if (type == SOCKET_LISTENER) {
+
+		Mutex_Lock(&port_map_lock);
+		Mutex_Lock(&socketcb->lock);
 
+		// Leave the port to the other listeners, if any
+		rlnode* next = socketcb->listener_s.port_node.next;
+		if (PORT_MAP[socketcb->port] == socketcb)
+			PORT_MAP[socketcb->port] = (next == &socketcb->listener_s.port_node) ? NULL : next->obj;
+		rlist_remove(&socketcb->listener_s.port_node);
+		Mutex_Unlock(&port_map_lock);
+
+		// Fail the pending requests, they are released by their Connect
 		while (! is_rlist_empty(&socketcb->listener_s.queue)){
-			free(rlist_pop_front(&socketcb->listener_s.queue));
+			connection_request* req = rlist_pop_front(&socketcb->listener_s.queue)->request;
+			__atomic_fetch_sub(&socketcb->listener_s.pending, 1, __ATOMIC_RELAXED);
+			kernel_signal(&req->connected_cv);
 		}
 
 		// Broadcast that the listener socket is no longer available for new connections
 		kernel_broadcast(&socketcb->listener_s.req_available);
-		
-		PORT_MAP[socketcb->port] = NULL; //the listener is closed
 	}
 	// Handle peer socket type
-	else if (socketcb->type == SOCKET_PEER) {
+	else {
+		Mutex_Lock(&socketcb->lock);
 
-		pipe_reader_close(socketcb->peer_s.read_pipe);
-		pipe_writer_close(socketcb->peer_s.write_pipe);
+		if (type == SOCKET_PEER) {
+			pipe_reader_close(socketcb->peer_s.read_pipe);
+			pipe_writer_close(socketcb->peer_s.write_pipe);
+		}
+		// If SOCKET_UNBOUND, ignore
 	}
-	// If SOCKET_UNBOUND or otherwise, ignore
 
-	socketcb->refcount--;
-	if (socketcb->refcount < 0) // No connections, free socket
-		free(socketcb);
+	socket_decref(socketcb); // The reference of the fcb
 
 	return 0;
 }
 
+int socket_poll(void *socket_cb_t, poll_table* pt) {
+
+	socket_cb* socketcb = (socket_cb*) socket_cb_t;
+	int ret = 0;
+
+	// The pipes cannot be closed while we register on them
+	Mutex_Lock(&socketcb->lock);
+
+	if (socketcb->type == SOCKET_LISTENER) {
+		poll_register(pt, &socketcb->listener_s.pollers);
+		if (! is_rlist_empty(&socketcb->listener_s.queue))
+			ret = EV_READ;
+	}
+	else if (socketcb->type == SOCKET_PEER) {
+		// A direction that is shut down does not block
+		ret |= socketcb->peer_s.read_pipe ? pipe_reader_poll(socketcb->peer_s.read_pipe, pt) : EV_HUP;
+		ret |= socketcb->peer_s.write_pipe ? pipe_writer_poll(socketcb->peer_s.write_pipe, pt) : EV_HUP;
+	}
+	// An unbound socket is never ready
+
+	Mutex_Unlock(&socketcb->lock);
+	return ret;
+}
+
+/* The mode of a connection cannot change, nor the port sharing of a listener */
+int socket_setflags(void *socket_cb_t, int flags) {
+
+	socket_cb* socketcb = (socket_cb*) socket_cb_t;
+	int ret = 0;
+
+	Mutex_Lock(&socketcb->lock);
+	if (socketcb->type == SOCKET_PEER && ((flags ^ socketcb->fcb->flags) & FLAG_PACKET))
+		ret = -1;
+	if (socketcb->type == SOCKET_LISTENER && ((flags ^ socketcb->fcb->flags) & FLAG_REUSEPORT))
+		ret = -1;
+	Mutex_Unlock(&socketcb->lock);
+
+	return ret;
+}
+
 
 static file_ops socket_file_ops = {
 	.Open = NULL,
 	.Read = socket_read,
 	.Write = socket_write,
+	.Splice = socket_splice,
+	.ReadV = socket_readv,
+	.WriteV = socket_writev,
+	.Poll = socket_poll,
+	.SetFlags = socket_setflags,
 	.Close = socket_close
 };
 
-Fid_t sys_Socket(port_t port)
+
+/*
+	Return the socket of a fid with a new reference, or NULL if the
+	fid is not a socket. The reference is dropped by put_socket().
+ */
+static socket_cb* get_socket(Fid_t fid)
 {
-	FCB* fcb;	
-	Fid_t fid;
+	FCB* fcb = get_fcb_ref(fid);
+	if (fcb == NULL)
+		return NULL;
+
+	socket_cb* socketcb = NULL;
+	if (fcb->streamfunc == &socket_file_ops) {
+		socketcb = fcb->streamobj;
+		Mutex_Lock(&socketcb->lock);
+		socketcb->refcount++;
+		Mutex_Unlock(&socketcb->lock);
+	}
 
-	if (port < 0 || port > MAX_PORT){  // Illegal Port
-		
-		return NOFILE;
-	}	
-		
+	FCB_decref(fcb);
+	return socketcb;
+}
 
-	if (FCB_reserve(1, &fid, &fcb) == 0){
+static void put_socket(socket_cb* socketcb)
+{
+	Mutex_Lock(&socketcb->lock);
+	socket_decref(socketcb);
+}
+
+
+/*
+	Create an unbound socket on a reserved fid, or return NULL. The fid
+	cannot be used by other threads until FCB_setup() is called on 
+	socketcb->fcb, or it is released by FCB_unreserve().
+ */
+static socket_cb* socket_create(port_t port, Fid_t* fid)
+{
+	FCB* fcb;
+
+	if (FCB_reserve(1, fid, &fcb) == 0){
 		
-		return NOFILE; // Failed to acquire FCBs & fids.
+		return NULL; // Failed to acquire FCBs & fids.
 	}
 
-	socket_cb* socketcb = (socket_cb*) xmalloc(sizeof(socket_cb)); // Allocate memory for socket_cb, terminates on failure
+	socket_cb* socketcb = socket_cache_get(); // Reuse or allocate a socket_cb
 
+	socketcb->lock = MUTEX_INIT;
 	socketcb->fcb = fcb;
-	socketcb->refcount = 0;
+	socketcb->refcount = 1;
 	socketcb->port = port;
 	socketcb->type = SOCKET_UNBOUND;
 
-	fcb->streamobj = socketcb;
-	fcb->streamfunc = &socket_file_ops;
+	return socketcb;
+}
+
 
+Fid_t sys_Socket(port_t port)
+{
+	Fid_t fid;
+
+	if (port < 0 || port > MAX_PORT){  // Illegal Port
+		
+		return NOFILE;
+	}	
+
+	socket_cb* socketcb = socket_create(port, &fid);
+	if (socketcb == NULL)
+		return NOFILE;
+
+	FCB_setup(socketcb->fcb, socketcb, &socket_file_ops);
 	return fid;
-	
 }
 
 int sys_Listen(Fid_t sock)
 {
-	if (sock == NOFILE || get_fcb(sock) == NULL || sock < 0 || sock > MAX_FILEID){  // Invalid fid
+	socket_cb* socketcb = get_socket(sock);
+
+	if (socketcb == NULL){  // Invalid fid
 		
 		return -1;
 	} 
-		
-	socket_cb* socketcb = get_fcb(sock)->streamobj;
 
-	if (socketcb == NULL || PORT_MAP[socketcb->port] != NULL || socketcb->port == NOPORT || socketcb->type != SOCKET_UNBOUND){  // Rest error conditions described in tinyos.h
-		
-		return -1;
+	int ret = -1;
+
+	Mutex_Lock(&port_map_lock);
+	Mutex_Lock(&socketcb->lock);
+
+	// Rest error conditions described in tinyos.h
+	if (socketcb->fcb != NULL && socketcb->port != NOPORT && socketcb->type == SOCKET_UNBOUND){
+
+		int reuseport = (socketcb->fcb->flags & FLAG_REUSEPORT) ? 1 : 0;
+		socket_cb* other = PORT_MAP[socketcb->port];
+
+		// The port is free, or shared by all its listeners
+		if (other == NULL || (reuseport && other->listener_s.reuseport)) {
+
+			socketcb->type = SOCKET_LISTENER;
+			
+			// Initialize listener
+			socketcb->listener_s.req_available = COND_INIT;
+			rlnode_init(&socketcb->listener_s.queue, NULL);
+			rlnode_new(&socketcb->listener_s.pollers);
+			rlnode_init(&socketcb->listener_s.port_node, socketcb);
+			socketcb->listener_s.pending = 0;
+			socketcb->listener_s.reuseport = reuseport;
+
+			// Install socket to the PORTMAP[], or join the other listeners
+			if (other == NULL)
+				PORT_MAP[socketcb->port] = socketcb; 
+			else
+				rlist_push_back(&other->listener_s.port_node, &socketcb->listener_s.port_node);
+
+			ret = 0;
+		}
 	}
 
-	// Install socket to the PORTMAP[]	
-	PORT_MAP[socketcb->port] = socketcb; 
-	
-	socketcb->type = SOCKET_LISTENER;
-	
-	// Initialize listener
-	socketcb->listener_s.req_available = COND_INIT;
-	rlnode_init(&socketcb->listener_s.queue, NULL);
+	Mutex_Unlock(&port_map_lock);
+	socket_decref(socketcb);
 
-	return 0;
+	return ret;
 }
 
 
 Fid_t sys_Accept(Fid_t lsock)
 {
-	if (lsock == NOFILE || lsock < 0 || lsock > MAX_FILEID || get_fcb(lsock) == NULL){ // Invalid fid
+	socket_cb* socketcb = get_socket(lsock);
+
+	if (socketcb == NULL){ // Invalid fid
 		return NOFILE;
 	} 
-		
-	socket_cb* socketcb = get_fcb(lsock)->streamobj;
 
-	if (socketcb == NULL || socketcb->type != SOCKET_LISTENER || PORT_MAP[socketcb->port] == NULL){  // Errors
-		return NOFILE;
+	Fid_t listen_peer = NOFILE;
+
+	Mutex_Lock(&socketcb->lock);
+
+	if (socketcb->type != SOCKET_LISTENER){  // Errors
+		goto finish;
 	} 
-		
-	socketcb->refcount++;
+
+	if (is_rlist_empty(&socketcb->listener_s.queue) 
+		&& socketcb->fcb != NULL && (socketcb->fcb->flags & FLAG_NONBLOCK)) {
+		listen_peer = WOULDBLOCK;
+		goto finish;
+	}
 
 	// While Request Queue is empty & socket has not exited
-	while (is_rlist_empty(&socketcb->listener_s.queue) && PORT_MAP[socketcb->port] != NULL){
+	while (is_rlist_empty(&socketcb->listener_s.queue) && socketcb->fcb != NULL){
 		 // Wait for a request to arrive.
-		kernel_wait(&socketcb->listener_s.req_available, SCHED_PIPE);//SCHED_PIPE); 
+		kernel_wait(&socketcb->lock, &socketcb->listener_s.req_available, SCHED_PIPE);
 	} 
 		
-	
-	if (PORT_MAP[socketcb->port] == NULL) { // Exited while waiting 
-		socketcb->refcount--;
-
-		// Free the socket control block if no other references remain
-		if (socketcb->refcount < 0){ 
-			free(socketcb);
-		}
-
-		return NOFILE;
+	if (socketcb->fcb == NULL) { // Exited while waiting 
+		goto finish;
 	}
 
 	connection_request* req = (rlist_pop_front(&socketcb->listener_s.queue))->request; // Get request from queue
-	// Create a new socket for the accepted connection
-	Fid_t listen_peer = sys_Socket(socketcb->port);
+	__atomic_fetch_sub(&socketcb->listener_s.pending, 1, __ATOMIC_RELAXED);
 
-	// If socket creation fails, clean up and return NOFILE.
-	if (listen_peer == NOFILE){
-		socketcb->refcount--;	
+	// Create a new socket for the accepted connection, hidden until it is connected
+	socket_cb* listenp = socket_create(socketcb->port, &listen_peer);
 
-		kernel_signal(&req->connected_cv);
+	// If socket creation fails, the request fails
+	if (listenp == NULL)
+		listen_peer = NOFILE;
+	else {
 
-		// Free the socket control block if no other references remain.
-		if (socketcb->refcount < 0){
-			free(socketcb);
-		}
+		// Cache sockets for efficiency & visual clarity
+		socket_cb* clientp = req->peer;
 
-		return NOFILE;
-	}
+		// Both ends must agree on packet mode, else the request is refused
+		int packet = socketcb->fcb->flags & FLAG_PACKET;
 
-	// Cache sockets for efficiency & visual clarity
-	socket_cb* clientp = req->peer;
-	socket_cb* listenp = get_fcb(listen_peer)->streamobj;
+		// The client is kept alive by its Connect, but may have been closed
+		Mutex_Lock(&clientp->lock);
+		if (clientp->fcb != NULL && (clientp->fcb->flags & FLAG_PACKET) == packet) {
 
-	// Initialize pipes for the client and listener
-	PIPE_CB* p1 = initialize_socket_pipe();
-	PIPE_CB* p2 = initialize_socket_pipe();
+			// Initialize pipes for the client and listener, p1 is read by the client
+			PIPE_CB* p1 = initialize_socket_pipe(clientp->fcb, listenp->fcb, packet);
+			PIPE_CB* p2 = initialize_socket_pipe(listenp->fcb, clientp->fcb, packet);
+			listenp->fcb->flags |= packet;
 
-	// Set up the pipes for communication between the client and listener.
-	clientp->peer_s.read_pipe = p1;
-	clientp->peer_s.write_pipe = p2;
+			// Set up the pipes for communication between the client and listener.
+			clientp->peer_s.read_pipe = p1;
+			clientp->peer_s.write_pipe = p2;
 
-	listenp->peer_s.read_pipe = p2;
-	listenp->peer_s.write_pipe = p1;
+			listenp->peer_s.read_pipe = p2;
+			listenp->peer_s.write_pipe = p1;
 
-	// Set the socket types to SOCKET_PEER to indicate they are connected peers
-	clientp->type = SOCKET_PEER;
-	listenp->type = SOCKET_PEER;
+			clientp->peer_s.read_users = clientp->peer_s.write_users = 0;
+			clientp->peer_s.read_shut = clientp->peer_s.write_shut = NULL;
+			listenp->peer_s.read_users = listenp->peer_s.write_users = 0;
+			listenp->peer_s.read_shut = listenp->peer_s.write_shut = NULL;
 
-	// Set mutual peer references between the client and listener for bidirectional communication
-	clientp->peer_s.peer = listenp;
-	listenp->peer_s.peer = clientp;
+			// Set the socket types to SOCKET_PEER to indicate they are connected peers
+			clientp->type = SOCKET_PEER;
+			listenp->type = SOCKET_PEER;
 
-	req->admitted = 1;
-	socketcb->refcount--;
+			// Set mutual peer references between the client and listener for bidirectional communication
+			clientp->peer_s.peer = listenp;
+			listenp->peer_s.peer = clientp;
 
-	if (socketcb->refcount < 0){
-		free(socketcb);
+			req->admitted = 1;
+		}
+		Mutex_Unlock(&clientp->lock);
+
+		if (req->admitted)
+			FCB_setup(listenp->fcb, listenp, &socket_file_ops);
+		else {
+			FCB* fcb = listenp->fcb;
+			FCB_unreserve(1, &listen_peer, &fcb);
+			socket_cache_put(listenp);
+			listen_peer = NOFILE;
+		}
 	}
 
-	// Signal the connection requester that the connection has been established
+	// Signal the connection requester that the connection has been established, or failed
 	kernel_signal(&(req->connected_cv));
 
+finish:
+	socket_decref(socketcb);
 	return listen_peer;
 }
 
 
+/*
+	Choose the listener of a port for a new request: the one with the 
+	shortest queue, starting from PORT_MAP[port], which then moves past 
+	the chosen one. The caller holds port_map_lock.
+ */
+static socket_cb* pick_listener(port_t port)
+{
+	socket_cb* first = PORT_MAP[port];
+	if (first == NULL)
+		return NULL;
+
+	socket_cb* best = first;
+	unsigned int best_pending = __atomic_load_n(&first->listener_s.pending, __ATOMIC_RELAXED);
+
+	for (rlnode* n = first->listener_s.port_node.next; n != &first->listener_s.port_node && best_pending > 0; n = n->next) {
+		socket_cb* s = n->obj;
+		unsigned int pending = __atomic_load_n(&s->listener_s.pending, __ATOMIC_RELAXED);
+		if (pending < best_pending) {
+			best = s;
+			best_pending = pending;
+		}
+	}
+
+	PORT_MAP[port] = best->listener_s.port_node.next->obj;
+	return best;
+}
+
+
 int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 {
-	if (sock == NOFILE || sock < 0 || sock > MAX_FILEID || get_fcb(sock) == NULL) // bad fid
+	if (port < 1 || port > MAX_PORT)
+		return -1;
+
+	socket_cb* client = get_socket(sock);
+
+	if (client == NULL) // bad fid
 		return NOFILE;
 
-	socket_cb* client = get_fcb(sock)->streamobj;
+	int ret = -1;
 
-	if (client == NULL || port < 1 || port > MAX_PORT || client->type != SOCKET_UNBOUND){
-		return -1;
-	}
+	Mutex_Lock(&client->lock);
+	int unbound = (client->type == SOCKET_UNBOUND);
+	Mutex_Unlock(&client->lock);
+
+	if (! unbound)
+		goto finish;
 	
-	socket_cb* listener = PORT_MAP[port];
-	if (listener == NULL || listener->type != SOCKET_LISTENER){
-		return -1;
+	Mutex_Lock(&port_map_lock);
+	socket_cb* listener = pick_listener(port);
+	if (listener == NULL){
+		Mutex_Unlock(&port_map_lock);
+		goto finish;
 	}
+	Mutex_Lock(&listener->lock);
+	Mutex_Unlock(&port_map_lock);
 
-	connection_request* req = (connection_request *) xmalloc(sizeof(connection_request));
-	req->admitted = 0;
+	// Keep the listener alive while we wait on it
+	listener->refcount++;
 
-	rlnode_init(&req->queue_node, req);
-
-	req->peer = client;
-	req->connected_cv = COND_INIT;	
-	rlist_push_back(&listener->listener_s.queue, &req->queue_node); //rlnode_init(&req->queue_node, &req)); // Add peer node to server waiting queue
-	
+	// The request lives until we return, it is removed from the queue by then
+	connection_request req;
+	req.admitted = 0;
+	req.peer = client;
+	req.connected_cv = COND_INIT;	
+	rlnode_init(&req.queue_node, &req);
+	rlist_push_back(&listener->listener_s.queue, &req.queue_node); // Add peer node to server waiting queue
+	__atomic_fetch_add(&listener->listener_s.pending, 1, __ATOMIC_RELAXED);
 
 	kernel_signal(&listener->listener_s.req_available); // signal to listener the initialization of peer connection
+	poll_notify(&listener->listener_s.pollers, EV_READ);
 
-	client->refcount ++;
-	 
-	/*if (timeout > 0)
-		kernel_timedwait(&(req->connected_cv), SCHED_PIPE, timeout);
-	else
-		kernel_wait(&(req->connected_cv), SCHED_PIPE);
-	*/
-	kernel_timedwait(&req->connected_cv, SCHED_PIPE, timeout); // Wait for connection, if timeout time passes, we stop waiting
-
-	client->refcount --;
+	kernel_timedwait(&listener->lock, &req.connected_cv, SCHED_PIPE, timeout); // Wait for connection, if timeout time passes, we stop waiting
 
-	if (client->refcount < 0){
-		free(client);
+	if (req.queue_node.next != &req.queue_node) { // Still queued, if we timed out
+		rlist_remove(&req.queue_node);
+		__atomic_fetch_sub(&listener->listener_s.pending, 1, __ATOMIC_RELAXED);
 	}
-	
-	// We want to keep return value after freeing the request node
-	int ret = req->admitted ? 0 : -1; // 0 on successful connection, -1 on failure
-	
-	rlist_remove(&req->queue_node);
-	free(req);
+	ret = req.admitted ? 0 : -1; // 0 on successful connection, -1 on failure
+
+	socket_decref(listener);
 
+finish:
+	put_socket(client);
 	return ret;
 }
 
 
 int sys_ShutDown(Fid_t sock, shutdown_mode how)
 {
-	if (sock == NOFILE || sock < 0 || sock > MAX_FILEID || get_fcb(sock) == NULL) // bad fid
+	socket_cb* socketcb = get_socket(sock);
+
+	if (socketcb == NULL) // bad fid
 		return NOFILE;
 
-	socket_cb* socketcb = get_fcb(sock)->streamobj;
+	int ret = 0;
 
-	if (socketcb == NULL || socketcb->type != SOCKET_PEER) // Error
-		return -1;
+	Mutex_Lock(&socketcb->lock);
 
+	if (socketcb->type != SOCKET_PEER) { // Error
+		ret = -1;
+		goto finish;
+	}
 
-	switch (how) { // Close pipes
-		case SHUTDOWN_READ:
-			// Close the read pipe for the peer socket and make the reference null
-			pipe_reader_close(socketcb->peer_s.read_pipe);
-			socketcb->peer_s.read_pipe = NULL;
-			break;
-		case SHUTDOWN_WRITE:
-			// Close the write pipe for the peer socket and make the reference null
-			pipe_writer_close(socketcb->peer_s.write_pipe);
-			socketcb->peer_s.write_pipe = NULL;
-			break;
-		case SHUTDOWN_BOTH:
-			// Close the read and write pipes for the peer socket and make both the references null
-			pipe_writer_close(socketcb->peer_s.write_pipe);
-			socketcb->peer_s.write_pipe = NULL;
-			pipe_reader_close(socketcb->peer_s.read_pipe);
-			socketcb->peer_s.read_pipe = NULL;
-			break;
-		default:
-			break;
+	// Detach the pipes; one that is in use is closed by its last user
+	peer_socket* p = &socketcb->peer_s;
+	if ((how == SHUTDOWN_WRITE || how == SHUTDOWN_BOTH) && p->write_pipe != NULL) {
+		if (p->write_users == 0)
+			pipe_writer_close(p->write_pipe);
+		else
+			p->write_shut = p->write_pipe;
+		p->write_pipe = NULL;
+	}
+	if ((how == SHUTDOWN_READ || how == SHUTDOWN_BOTH) && p->read_pipe != NULL) {
+		if (p->read_users == 0)
+			pipe_reader_close(p->read_pipe);
+		else
+			p->read_shut = p->read_pipe;
+		p->read_pipe = NULL;
 	}
-	return 0;
-}
 
+finish:
+	socket_decref(socketcb);
+	return ret;
+}
@@ -17,16 +17,29 @@ typedef enum socket_type {
 typedef struct listener_socket_type {
 	rlnode queue;
 	CondVar req_available;
+	rlnode pollers; // Notified when a request is queued
+	rlnode port_node; // Ring of the listeners of the port, under port_map_lock
+	unsigned int pending; // Length of queue, read without the lock by Connect
+	int reuseport; // Set by Listen, under port_map_lock
 } listener_socket;
 
 typedef struct unbound_socket_type {
 	rlnode unbound_socket;
 } unbound_socket;
 
+/*
+	A Read or Write uses a pipe without the socket lock, counted in 
+	read_users or write_users. ShutDown detaches the pipe from the socket,
+	and if it is in use, leaves it in read_shut or write_shut for the 
+	last user to close.
+ */
 typedef struct peer_socket_type {
 	socket_cb* peer;
 	PIPE_CB* write_pipe;
 	PIPE_CB* read_pipe;
+	unsigned int read_users, write_users;
+	PIPE_CB* read_shut;
+	PIPE_CB* write_shut;
 } peer_socket;
 
 typedef struct socket_connection_request {
@@ -39,7 +52,18 @@ typedef struct socket_connection_request {
 
 socket_cb* PORT_MAP[MAX_PORT+1] = {NULL}; // Initialize all ports as null.
 
+/** @brief The maximum number of free sockets kept for reuse. */
+#ifndef SOCKET_CACHE_MAX
+#define SOCKET_CACHE_MAX 64
+#endif
+
+/*
+	A socket is freed when its refcount drops to 0. The FCB holds one 
+	reference, and every thread blocked in Accept or Connect on it holds 
+	another. The fcb is set to NULL when the stream is closed.
+ */
 typedef struct socket_control_block {
+	Mutex lock; // Protects all fields below
 	unsigned int refcount;
 	FCB* fcb;
 	socket_type type;
@@ -56,6 +80,11 @@ typedef struct socket_control_block {
 int socket_close();
 int socket_read();
 int socket_write();
+int socket_splice();
+int socket_readv();
+int socket_writev();
+int socket_poll();
+int socket_setflags();
 
 int grab_fid(FCB* fcb);
 void initialize_Socket(port_t port, FCB* fcb);
@@ -11,6 +11,12 @@
 FCB FT[MAX_FILES];
 rlnode FCB_freelist;
 
+/* Protects FT, FCB_freelist and the FIDT of every process */
+static Mutex files_lock = MUTEX_INIT;
+
+/* Serializes SetFlags, so that streams see the flags they accepted */
+static Mutex flags_lock = MUTEX_INIT;
+
 
 void initialize_files()
 {
@@ -29,6 +35,10 @@ FCB* acquire_FCB()
   if(! is_rlist_empty(& FCB_freelist)) {
     FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
     fcb->refcount = 0;
+    fcb->streamobj = NULL;
+    fcb->streamfunc = NULL;
+    fcb->flags = 0;
+    rlnode_new(&fcb->evq_items);
     return fcb;
   }
   else
@@ -44,22 +54,43 @@ void release_FCB(FCB* fcb)
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
+  Mutex_Lock(&files_lock);
   fcb->refcount++;
+  Mutex_Unlock(&files_lock);
 }
 
 int FCB_decref(FCB* fcb)
 {
   assert(fcb);
+  Mutex_Lock(&files_lock);
   fcb->refcount --;
-  if(fcb->refcount==0) {
+  int last = (fcb->refcount==0);
+  Mutex_Unlock(&files_lock);
+
+  if(last) {
+    /* Nobody else can see this fcb, close it without the lock */
+    evq_stream_closed(fcb);
     int retval = fcb->streamfunc->Close(fcb->streamobj);
+    Mutex_Lock(&files_lock);
     release_FCB(fcb);
+    Mutex_Unlock(&files_lock);
     return retval;
   }
   else
     return 0;
 }
 
+void FIDT_copy(FCB** dst, FCB** src)
+{
+  Mutex_Lock(&files_lock);
+  for(int i=0; i<MAX_FILEID; i++) {
+    /* A stream that is still being set up is not copied */
+    dst[i] = (src[i] && src[i]->streamfunc) ? src[i] : NULL;
+    if(dst[i]) dst[i]->refcount++;
+  }
+  Mutex_Unlock(&files_lock);
+}
+
 
 
 int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
@@ -68,6 +99,8 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
     size_t f=0;
     uint i;
 
+    Mutex_Lock(&files_lock);
+
     /* Find distinct fids */
     for(i=0; i<num; i++) {
 	while(f<MAX_FILEID && cur->FIDT[f]!=NULL)
@@ -75,7 +108,7 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	if(f==MAX_FILEID) break;
 	fid[i] = f; f++;
     }
-    if(i<num) return 0;
+    if(i<num) goto fail;
     /* Allocate FCBs */
     for(i=0;i<num;i++)
 	if((fcb[i] = acquire_FCB()) == NULL)
@@ -86,26 +119,42 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	    release_FCB(fcb[i-1]);
 	    i--;
 	}
-	return 0;
+	goto fail;
     }
     /* Found all */
     for(i=0;i<num;i++) {
 	cur->FIDT[fid[i]]=fcb[i];
-	FCB_incref(fcb[i]);
+	fcb[i]->refcount++;
     }
+    Mutex_Unlock(&files_lock);
     return 1;
+
+fail:
+    Mutex_Unlock(&files_lock);
+    return 0;
 }
 
 
 
+void FCB_setup(FCB* fcb, void* streamobj, file_ops* streamfunc)
+{
+  Mutex_Lock(&files_lock);
+  fcb->streamobj = streamobj;
+  fcb->streamfunc = streamfunc;
+  Mutex_Unlock(&files_lock);
+}
+
+
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
+    Mutex_Lock(&files_lock);
     for(size_t i=0; i<num ; i++) {
 	assert(cur->FIDT[fid[i]]==fcb[i]);
 	cur->FIDT[fid[i]] = NULL;
 	release_FCB(fcb[i]);
     }
+    Mutex_Unlock(&files_lock);
 }
 
 
@@ -128,6 +177,73 @@ FCB* get_fcb(Fid_t fid)
 }
 
 
+FCB* get_fcb_ref(Fid_t fid)
+{
+  if(fid < 0 || fid >= MAX_FILEID) return NULL;
+
+  Mutex_Lock(&files_lock);
+  FCB* fcb = CURPROC->FIDT[fid];
+  /* A stream that is still being set up is not visible */
+  if(fcb && fcb->streamfunc)
+    fcb->refcount++;
+  else
+    fcb = NULL;
+  Mutex_Unlock(&files_lock);
+  return fcb;
+}
+
+
+int FCB_poll(FCB* fcb, poll_table* pt)
+{
+  if(fcb->streamfunc->Poll)
+    return fcb->streamfunc->Poll(fcb->streamobj, pt);
+
+  return (fcb->streamfunc->Read ? EV_READ : 0) | (fcb->streamfunc->Write ? EV_WRITE : 0);
+}
+
+
+/*
+  Whether an operation (EV_READ or EV_WRITE) on a non-blocking stream 
+  would block. Pipes, sockets and terminals also check this as they 
+  copy, under their own locks, since the state may change after this
+  check; for the other streams, this check is enough.
+ */
+static int would_block(FCB* fcb, int events)
+{
+  return (fcb->flags & FLAG_NONBLOCK) && !(FCB_poll(fcb, NULL) & (events | EV_HUP));
+}
+
+
+int sys_SetFlags(Fid_t fid, int flags)
+{
+  if(flags & ~(FLAG_NONBLOCK | FLAG_PACKET | FLAG_REUSEPORT))
+    return -1;
+
+  FCB* fcb = get_fcb_ref(fid);
+  if(fcb == NULL)
+    return -1;
+
+  int retcode = 0;
+
+  Mutex_Lock(&flags_lock);
+
+  /* The stream decides on the flags, other than FLAG_NONBLOCK */
+  if(fcb->streamfunc->SetFlags)
+    retcode = fcb->streamfunc->SetFlags(fcb->streamobj, flags);
+  else if(flags & ~FLAG_NONBLOCK)
+    retcode = -1;
+
+  /* I/O calls read the flags without the lock */
+  if(retcode == 0)
+    __atomic_store_n(&fcb->flags, flags, __ATOMIC_RELAXED);
+
+  Mutex_Unlock(&flags_lock);
+
+  FCB_decref(fcb);
+  return retcode;
+}
+
+
 int sys_Read(Fid_t fd, char *buf, unsigned int size)
 {
   int retcode = -1;
@@ -135,27 +251,22 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
   void* sobj;
 
   
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* Get the fields from the stream. We hold a reference, to make 
+     sure that the stream will not be closed (by another thread) 
+     while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
     sobj = fcb->streamobj;
     devread = fcb->streamfunc->Read;
-
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
   
     if(devread)
-      retcode = devread(sobj, buf, size);
+      retcode = would_block(fcb, EV_READ) ? WOULDBLOCK : devread(sobj, buf, size);
 
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
   }
   
-  /* We must not go into non-preemptive domain with kernel_mutex locked */
-
-
   return retcode;
 }
 
@@ -167,21 +278,16 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
   void* sobj = NULL;
 
   
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* Get the fields from the stream, holding a reference */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
 
     sobj = fcb->streamobj;
     devwrite = fcb->streamfunc->Write;
 
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
-
     if(devwrite)
-      retcode = devwrite(sobj, buf, size);
+      retcode = would_block(fcb, EV_WRITE) ? WOULDBLOCK : devwrite(sobj, buf, size);
 
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
@@ -193,14 +299,161 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 }
 
 
+/* Size of the buffer used by Splice for streams without a Splice method */
+#define SPLICE_BOUNCE_SIZE 1024
+
+/*
+  Splice through a bounce buffer, using Read and Write. 
+  Like Read, stop at a short read.
+ */
+static int splice_bounce(FCB* in, FCB* out, unsigned int len)
+{
+  char bounce[SPLICE_BOUNCE_SIZE];
+  unsigned int moved = 0;
+
+  while(moved < len) {
+    unsigned int n = len - moved;
+    if(n > SPLICE_BOUNCE_SIZE) n = SPLICE_BOUNCE_SIZE;
+
+    int rc = in->streamfunc->Read(in->streamobj, bounce, n);
+    if(rc <= 0) {
+      if(rc < 0 && moved == 0) return rc;
+      break;
+    }
+
+    int wc = out->streamfunc->Write(out->streamobj, bounce, rc);
+    if(wc < 0) 
+      return (moved == 0) ? wc : (int) moved;
+    moved += wc;
+    if(wc < rc || (unsigned int) rc < n) 
+      break;
+  }
+
+  return moved;
+}
+
+
+int sys_Splice(Fid_t in, Fid_t out, unsigned int len)
+{
+  int retcode = -1;
+
+  /* Hold references to both streams, like Read and Write */
+  FCB* fin = get_fcb_ref(in);
+  FCB* fout = get_fcb_ref(out);
+
+  if(fin && fout && fout->streamfunc->Write 
+     && (fin->streamfunc->Splice || fin->streamfunc->Read)) {
+    if(would_block(fin, EV_READ) || would_block(fout, EV_WRITE))
+      retcode = WOULDBLOCK;
+    else if(fin->streamfunc->Splice)
+      retcode = fin->streamfunc->Splice(fin->streamobj, 
+        fout->streamfunc->Write, fout->streamobj, len);
+    else
+      retcode = splice_bounce(fin, fout, len);
+  }
+
+  if(fin) FCB_decref(fin);
+  if(fout) FCB_decref(fout);
+
+  return retcode;
+}
+
+
+
+/*
+  Vectored I/O for streams without ReadV/WriteV methods: one Read or 
+  Write per buffer, stopping at a short count, like Read and Write.
+ */
+static int rw_loop(FCB* fcb, const iovec_t* iov, unsigned int iovcnt, int write)
+{
+  int moved = 0;
+
+  for(unsigned int k = 0; k < iovcnt; k++) {
+    if(iov[k].len == 0) continue;
+
+    int rc = write 
+      ? fcb->streamfunc->Write(fcb->streamobj, iov[k].base, iov[k].len)
+      : fcb->streamfunc->Read(fcb->streamobj, iov[k].base, iov[k].len);
+
+    if(rc < 0)
+      return (moved == 0) ? rc : moved;
+    moved += rc;
+    if((unsigned int) rc < iov[k].len)
+      break;
+  }
+
+  return moved;
+}
+
+
+int sys_ReadV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt)
+{
+  int retcode = -1;
+
+  if(iov == NULL && iovcnt > 0)
+    return -1;
+
+  FCB* fcb = get_fcb_ref(fd);
+
+  if(fcb) {
+    if(would_block(fcb, EV_READ) && (fcb->streamfunc->ReadV || fcb->streamfunc->Read))
+      retcode = WOULDBLOCK;
+    else if(fcb->streamfunc->ReadV)
+      retcode = fcb->streamfunc->ReadV(fcb->streamobj, iov, iovcnt);
+    else if(fcb->streamfunc->Read)
+      retcode = rw_loop(fcb, iov, iovcnt, 0);
+
+    FCB_decref(fcb);
+  }
+
+  return retcode;
+}
+
+
+int sys_WriteV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt)
+{
+  int retcode = -1;
+
+  if(iov == NULL && iovcnt > 0)
+    return -1;
+
+  FCB* fcb = get_fcb_ref(fd);
+
+  if(fcb) {
+    if(would_block(fcb, EV_WRITE) && (fcb->streamfunc->WriteV || fcb->streamfunc->Write))
+      retcode = WOULDBLOCK;
+    else if(fcb->streamfunc->WriteV)
+      retcode = fcb->streamfunc->WriteV(fcb->streamobj, iov, iovcnt);
+    else if(fcb->streamfunc->Write)
+      retcode = rw_loop(fcb, iov, iovcnt, 1);
+
+    FCB_decref(fcb);
+  }
+
+  return retcode;
+}
+
+
 int sys_Close(int fd)
 {
   int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
 
-  FCB* fcb = get_fcb(fd);
+  FCB* fcb = NULL;
+
+  if(retcode==0) {
+    Mutex_Lock(&files_lock);
+    fcb = CURPROC->FIDT[fd];
+    /* A stream that is still being set up belongs to its creator */
+    if(fcb && fcb->streamfunc == NULL) {
+      fcb = NULL;
+      retcode = -1;
+    }
+    else
+      CURPROC->FIDT[fd] = NULL;
+    Mutex_Unlock(&files_lock);
+  }
 
   if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
     retcode = FCB_decref(fcb);    
   }
 
@@ -214,6 +467,7 @@ int sys_Close(int fd)
   This call returns 0 on success and -1 on failure.
   Possible reasons for failure:
   - Either oldfd or newfd is invalid.
+  - Either oldfd or newfd is a stream that is still being set up.
  */
 int sys_Dup2(int oldfd, int newfd)
 {
@@ -221,19 +475,26 @@ int sys_Dup2(int oldfd, int newfd)
   if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
     return -1;
 
+  Mutex_Lock(&files_lock);
+
   FCB* old = get_fcb(oldfd);
   FCB* new = get_fcb(newfd);
 
-  if(old==NULL) {
+  if(old==NULL || old->streamfunc==NULL || (new!=NULL && new->streamfunc==NULL)) {
+    old = NULL;
     retcode = -1;
   }
   else if(old!=new) {
-    if(new)
-      FCB_decref(new);
-    FCB_incref(old);
+    old->refcount++;
     CURPROC->FIDT[newfd] = old;
   }
 
+  Mutex_Unlock(&files_lock);
+
+  /* Close the replaced stream without the lock */
+  if(old!=NULL && new!=NULL && old!=new)
+    FCB_decref(new);
+
   return retcode;
 }
 
@@ -254,13 +515,17 @@ Fid_t open_stream(Device_type major, unsigned int minor)
   FCB* fcb;
 
 
+  void* streamobj;
+  file_ops* streamfunc;
+
   if(! FCB_reserve(1, &fid, &fcb))
       goto finerr;
   
-  if(device_open(major, minor, & fcb->streamobj, &fcb->streamfunc)) {
+  if(device_open(major, minor, &streamobj, &streamfunc)) {
       FCB_unreserve(1, &fid, &fcb);
       goto finerr;
   }
+  FCB_setup(fcb, streamobj, streamfunc);
   
   goto finok;
 finerr:
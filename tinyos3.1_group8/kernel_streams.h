@@ -20,8 +20,12 @@
 
 	The streams of each process are held in the file table of the
 	PCB of the process. The system calls generally use the API
-	of this file to access FCBs: @ref get_fcb, @ref FCB_reserve
-	and @ref FCB_unreserve.
+	of this file to access FCBs: @ref get_fcb, @ref get_fcb_ref,
+	@ref FCB_reserve, @ref FCB_setup and @ref FCB_unreserve.
+
+	The FCB table, the reference counts and the fileid tables are 
+	protected by a single files lock, which is internal to this API.
+	The @c Close method of a stream is called without this lock held.
 
 	Streams are connected to devices by virtue of a @c file_operations
 	object, which provides pointers to device-specific implementations
@@ -43,6 +47,8 @@ typedef struct file_control_block
   uint refcount;  			/**< @brief Reference counter. */
   void* streamobj;			/**< @brief The stream object (e.g., a device) */
   file_ops* streamfunc;		/**< @brief The stream implementation methods */
+  int flags;				/**< @brief The flags set by @c SetFlags */
+  rlnode evq_items;			/**< @brief The event queue items of the stream */
   rlnode freelist_node;		/**< @brief Intrusive list node */
 } FCB;
 
@@ -90,6 +96,9 @@ int FCB_decref(FCB* fcb);
    If these resources are not needed, the operation can be
    reversed by calling @ref FCB_unreserve.
 
+   The fids are taken, but other threads of the process cannot
+   use, close or copy them, until @ref FCB_setup is called.
+
    @param num the number of resources to reserve.
    @param fid array of size at least `num` of `Fid_t`.
    @param fcb array of size at least `num` of `FCB*`.
@@ -98,6 +107,18 @@ int FCB_decref(FCB* fcb);
 int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb);
 
 
+/** @brief Attach a stream to a reserved FCB.
+
+   This sets the stream object and the methods of an FCB returned
+   by @ref FCB_reserve, and makes its fid usable by all threads.
+
+   @param fcb the FCB
+   @param streamobj the stream object
+   @param streamfunc the stream methods
+*/
+void FCB_setup(FCB* fcb, void* streamobj, file_ops* streamfunc);
+
+
 /** @brief Release a number of FCBs and corresponding fids.
 
    Given an array of fids of size @ num, this function will 
@@ -122,12 +143,50 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 
 	This routine will return NULL if the fid is not legal.
 
+	Note that another thread of the process may close the fid
+	at any time. To use the stream, call @ref get_fcb_ref instead.
+
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
  */
 FCB* get_fcb(Fid_t fid);
 
 
+/** @brief Translate an fid to an FCB, and take a reference to it.
+
+	This is like @ref get_fcb, but the stream will not be closed
+	until the caller releases the reference with @ref FCB_decref.
+
+	@param fid the file ID to translate to a pointer to FCB
+	@returns a pointer to the corresponding FCB, or NULL.
+ */
+FCB* get_fcb_ref(Fid_t fid);
+
+
+/** @brief Copy a fileid table.
+
+	Every FCB in @c src is copied into @c dst, and its reference
+	count is increased, except for those that are still being set up.
+	This is used by @c Exec.
+
+	@param dst the fileid table to copy into
+	@param src the fileid table to copy from
+ */
+void FIDT_copy(FCB** dst, FCB** src);
+
+
+/** @brief The readiness of a stream.
+
+	This calls the @c Poll method of the stream. Streams without one
+	are always ready for the operations they support.
+
+	@param fcb the stream, on which the caller holds a reference
+	@param pt the registrations, or NULL
+	@returns a combination of @c EV_READ, @c EV_WRITE and @c EV_HUP
+ */
+int FCB_poll(FCB* fcb, poll_table* pt);
+
+
 /** @} */
 
 #endif
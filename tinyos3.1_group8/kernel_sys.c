@@ -12,13 +12,15 @@
  */
 
 
-#define PRE_CALL \
-kernel_lock();\
-
+/*
+	There is no big kernel lock around system calls. Each
+	system call locks the kernel objects it touches, see
+	kernel_cc.h for the lock order.
+ */
+#define PRE_CALL
 
 
-#define POST_CALL \
-kernel_unlock();\
+#define POST_CALL
 
 
 /* with return */
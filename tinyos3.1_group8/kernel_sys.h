@@ -11,6 +11,7 @@ SYSCALL(GetPid, int, (void), ())\
 SYSCALL(GetPPid, int, (void), ())\
 SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
 SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(CreateThreadWithStack, Tid_t, (Task task, int argl, void* args, unsigned int stack_size), (task, argl, args, stack_size))\
 SYSCALL(ThreadSelf, Tid_t, (void), ())\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
@@ -20,9 +21,18 @@ SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
 SYSCALL(OpenNull, Fid_t, (), ())\
 SYSCALL(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
 SYSCALL(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
+SYSCALL(Splice,int,(Fid_t in, Fid_t out, unsigned int len), (in,out,len))\
+SYSCALL(ReadV,int,(Fid_t fd, const iovec_t* iov, unsigned int iovcnt), (fd,iov,iovcnt))\
+SYSCALL(WriteV,int,(Fid_t fd, const iovec_t* iov, unsigned int iovcnt), (fd,iov,iovcnt))\
+SYSCALL(Poll,int,(pollfid_t* fids, unsigned int n, timeout_t timeout), (fids,n,timeout))\
+SYSCALL(SetFlags,int,(Fid_t fid, int flags), (fid,flags))\
+SYSCALL(EventQueue,Fid_t,(),())\
+SYSCALL(EventCtl,int,(Fid_t evq, evq_op op, Fid_t fid, int events), (evq,op,fid,events))\
+SYSCALL(EventWait,int,(Fid_t evq, pollfid_t* events, unsigned int max, timeout_t timeout), (evq,events,max,timeout))\
 SYSCALL(Close,int,(Fid_t fd),(fd))\
 SYSCALL(Dup2,int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd))\
 SYSCALL(Pipe, int, (pipe_t* pipe), (pipe))\
+SYSCALL(PipeWithSize, int, (pipe_t* pipe, unsigned int size), (pipe, size))\
 SYSCALL(Socket, Fid_t, (port_t port), (port))\
 SYSCALL(Listen, int, (Fid_t sock), (sock))\
 SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
@@ -24,11 +24,23 @@
 
 Tid_t sys_CreateThread(Task task, int argl, void *args)
 {
-  
+  return sys_CreateThreadWithStack(task, argl, args, THREAD_STACK_SIZE);
+}
+
+/**
+  @brief Create a new thread in the current process, with a given stack size.
+  */
+Tid_t sys_CreateThreadWithStack(Task task, int argl, void *args, unsigned int stack_size)
+{
+  if (stack_size == 0)
+    stack_size = THREAD_STACK_SIZE;
+
   /* Initialize and return a new TCB */
   PCB *pcb = CURPROC;
   TCB *tcb;
-  tcb = spawn_thread(pcb, start_main_thread_process);
+  tcb = spawn_thread_stack(pcb, start_main_thread_process, stack_size);
+  if (tcb == NULL)
+    return NOTHREAD;
   /*  and acquire a new PTCB */
   PTCB *ptcb;
   ptcb = (PTCB *)xmalloc(sizeof(PTCB)); /* Memory allocation for the new PTCB */
@@ -47,8 +59,11 @@ Tid_t sys_CreateThread(Task task, int argl, void *args)
   ptcb->refcount = 0;
    rlnode_init(&ptcb->ptcb_node_list, ptcb); /* Initialize node list with PTCB being the node key */
   //ptcb->ptcb_node_list = *rlnode_init(&ptcb->ptcb_node_list, ptcb);
+  Mutex_Lock(&proc_lock);
   rlist_push_back(&CURPROC->ptcb_list, &ptcb->ptcb_node_list);
   pcb->thread_count++;
+  Mutex_Unlock(&proc_lock);
+
   wakeup(tcb);
 
   return (Tid_t)ptcb;
@@ -71,22 +86,25 @@ int sys_ThreadJoin(Tid_t tid, int *exitval)
 {
   PTCB *ptcb = (PTCB *)tid;
   //PCB* pcb= CURPROC;
+  int ret = -1;
+
+  Mutex_Lock(&proc_lock);
 
   if (rlist_find(&CURPROC->ptcb_list, ptcb, NULL) == NULL) /*search the list of ptcbs looking for ptcb with the given id(key)*/
   {
-    return -1; /*if it's null return error.*/
+    goto finish; /*if it's null return error.*/
   }
 
   /*if id of thread calling thread join is the same as the given id return error.*/
   if (sys_ThreadSelf() == tid) 
   {
-    return -1;
+    goto finish;
   }
 
   /*if the thread that calling thread wants to join is detached return error*/
   if (ptcb->detached == 1) 
   {
-    return -1;
+    goto finish;
   }
 
   /*increase value of refcount because we refered to this ptcb*/
@@ -94,14 +112,14 @@ int sys_ThreadJoin(Tid_t tid, int *exitval)
 
   while (ptcb->exited == 0 && ptcb->detached == 0)
   {
-    kernel_wait(&ptcb->exit_cv, SCHED_USER);
+    kernel_wait(&proc_lock, &ptcb->exit_cv, SCHED_USER);
   }
   ptcb->refcount--;
 
   /*if the thread that calling thread wants to join is detached return error*/
   if (ptcb->detached == 1) 
   {
-    return -1;
+    goto finish;
   }
 
   if (exitval != NULL)
@@ -114,8 +132,11 @@ int sys_ThreadJoin(Tid_t tid, int *exitval)
     rlist_remove(&ptcb->ptcb_node_list);
     free(ptcb);
   }
+  ret = 0;
 
-  return 0;
+finish:
+  Mutex_Unlock(&proc_lock);
+  return ret;
 }
 
 /**
@@ -124,23 +145,29 @@ int sys_ThreadJoin(Tid_t tid, int *exitval)
 int sys_ThreadDetach(Tid_t tid)
 {
   PTCB *ptcb = (PTCB *)tid; // to be able to have access to attributes of this thread
+  int ret = -1;
+
+  Mutex_Lock(&proc_lock);
 
   // check if ptcb exists in the list of the current process(CURPROC)
   if (rlist_find(&CURPROC->ptcb_list, ptcb, NULL) == NULL)
   {
-    return -1;
+    goto finish;
   }
 
   if (ptcb->exited == 1)
   { // Check if the flag exited is on.If it is return error.
-    return -1;
+    goto finish;
   }
 
   // if everything is right make detach flag on.
   ptcb->detached = 1; 
   kernel_broadcast(&ptcb->exit_cv);
+  ret = 0;
 
-  return 0;
+finish:
+  Mutex_Unlock(&proc_lock);
+  return ret;
 }
 
 /**
@@ -152,6 +179,8 @@ void sys_ThreadExit(int exitval)
   TCB *tcb = cur_thread();
   PTCB *ptcb = tcb->ptcb;
 
+  Mutex_Lock(&proc_lock);
+
   curproc->thread_count--; // Thread is going to get deleted
   ptcb->exited = 1;
   ptcb->exitval = exitval;
@@ -224,5 +253,5 @@ void sys_ThreadExit(int exitval)
 
 
   /* Bye-bye cruel world */
-  kernel_sleep(EXITED, SCHED_USER);
+  kernel_sleep(&proc_lock, EXITED, SCHED_USER);
 }
@@ -52,6 +52,10 @@ typedef int Fid_t;
 /** @brief The invalid file id. */
 #define NOFILE  (-1)
 
+/** @brief Returned by I/O calls on non-blocking streams, instead of blocking.
+   @see SetFlags */
+#define WOULDBLOCK  (-2)
+
 
 /**
   @brief The type of a thread ID.
@@ -92,7 +96,8 @@ typedef char Mutex;
 /** @brief Lock a mutex.
 
   Lock a mutex, by waiting if necessary, as long as it takes. In user-space and
-  in kernel-space (preemptive domain), the locking will yield after spinning for a few hundred times.
+  in kernel-space (preemptive domain), the locking thread will sleep after spinning 
+  for a short while, until it is woken up by @c Mutex_Unlock.
   In scheduler space (non-preemptive domain), the mutex lock operation is pure spinlock.
 
   @see Mutex
@@ -319,6 +324,30 @@ Pid_t GetPPid(void);
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
+/** 
+  @brief Create a new thread in the current process, with a given stack size.
+
+  This is like `CreateThread`, except that the new thread gets a stack
+  of (at least) `stack_size` bytes. The size is rounded up to a multiple 
+  of the page size, and to a minimum of 16 kbytes. A `stack_size` of 0 
+  gives the default stack size of 128 kbytes.
+
+  Thread stacks are only committed to memory as they are used, so that
+  a large stack does not cost memory unless it is actually needed. The
+  stack is followed by a guard page, so that a stack overflow crashes
+  the program instead of corrupting memory.
+
+  @param task a function to execute
+  @param argl the length of the argument
+  @param args the argument
+  @param stack_size the requested stack size in bytes
+  @returns the Tid of the new thread, or NOTHREAD if the thread
+     could not be created.
+
+  @see CreateThread
+  */
+Tid_t CreateThreadWithStack(Task task, int argl, void* args, unsigned int stack_size);
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -458,6 +487,212 @@ int Read(Fid_t fd, char *buf, unsigned int size);
 int Write(Fid_t fd, const char* buf, unsigned int size);
 
 
+/** @brief Move bytes from one stream to another.
+
+   This call has the effect of a @c Read of up to @c len bytes from
+   @c in, followed by a @c Write of them to @c out, but without copying
+   the data through a user buffer. When @c in is a pipe or a socket,
+   the data is moved directly out of its buffer. For other streams,
+   the kernel moves the data through a buffer of its own.
+
+   Like @c Read, the call blocks if no data is available from @c in.
+
+  @param in  the file ID of the stream to read from
+  @param out the file ID of the stream to write to
+  @param len maximum number of bytes to move
+  @return the number of bytes moved, 0 at end of data, or -1 on error.
+   Possible errors are:
+   - Either file id is invalid, @c in cannot be read or @c out cannot be written.
+   - @c in and @c out are the two ends of the same pipe, or @c out is the
+     peer of socket @c in, so the data would come back to @c in.
+   - There was a I/O runtime problem.
+ */
+int Splice(Fid_t in, Fid_t out, unsigned int len);
+
+
+/**
+	@brief A buffer for vectored I/O.
+
+	An array of these describes a sequence of buffers, which
+	are read into (or written from) in order, by @c ReadV and @c WriteV.
+*/
+typedef struct iovec_s {
+	void* base;			/**< The start of the buffer */
+	unsigned int len;	/**< The size of the buffer */
+} iovec_t;
+
+
+/** @brief Read bytes from a stream into a number of buffers.
+
+   This is like @c Read, but the bytes read are placed in the
+   @c iovcnt buffers of @c iov, one after the other. A buffer
+   is filled completely before the next one is used.
+
+  @param fd  the file ID of the stream to read from
+  @param iov an array of @c iovcnt buffers
+  @param iovcnt the number of buffers
+  @return the total number of bytes copied, 0 if we have reached EOF, or -1, 
+        indicating some error. Possible errors are:
+         - The file descriptor is invalid.
+         - There was a I/O runtime problem.
+
+  @see Read
+ */
+int ReadV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt);
+
+
+/** @brief Write bytes to a stream from a number of buffers.
+
+   This is like @c Write, but the bytes are taken from the 
+   @c iovcnt buffers of @c iov, one after the other. For pipes and
+   sockets, the bytes of all buffers are made available to the reader 
+   together, so that, e.g., a message header and its payload are sent 
+   with one system call.
+
+  @param fd  the file ID of the stream to write to
+  @param iov an array of @c iovcnt buffers
+  @param iovcnt the number of buffers
+  @return the total number of bytes copied, or -1 on error.
+   Possible errors are:
+   - The file id is invalid.
+   - There was a I/O runtime problem.
+
+  @see Write
+ */
+int WriteV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt);
+
+
+/** 
+  @brief Readiness events of a stream, for @c Poll.
+ */
+typedef enum {
+  EV_READ=1,     /**< @c Read (or @c Accept) will not block. */
+  EV_WRITE=2,    /**< @c Write will not block. */
+  EV_HUP=4,      /**< The other end of the stream is closed. Always reported. */
+  EV_INVAL=8     /**< The file id is not an open stream. Always reported. */
+} poll_events;
+
+
+/**
+  @brief A stream to be watched by @c Poll.
+  */
+typedef struct poll_fid_s {
+  Fid_t fid;        /**< The stream to watch. If negative, the entry is ignored. */
+  int events;       /**< The events of interest, a combination of @c EV_READ and @c EV_WRITE */
+  int revents;      /**< Set by @c Poll to the events that occurred */
+} pollfid_t;
+
+
+/** @brief Wait until one of a number of streams is ready for I/O.
+
+   For each of the @c n entries of @c fids, this call sets @c revents 
+   to the events of interest (and @c EV_HUP and @c EV_INVAL) which 
+   hold for the stream. If none hold, the calling thread sleeps until 
+   one does, or until the timeout expires. It is woken up once, when 
+   any of the streams changes state.
+
+   Pipes, sockets and serial terminals report their actual readiness. 
+   Other streams are always ready for the operations they support.
+   A listening socket is ready for reading when @c Accept will not block.
+
+   This way, a single thread can serve many streams, without blocking
+   in any of them.
+
+  @param fids an array of @c n streams and events
+  @param n the number of entries in @c fids
+  @param timeout the time to wait, in msec. If it is 0, the call does
+     not sleep; if it is @c (timeout_t)-1, it waits indefinitely.
+  @return the number of entries with non-zero @c revents, 0 if the 
+    timeout expired, or -1 on error. Possible errors are:
+    - @c fids is NULL and @c n is not 0.
+ */
+int Poll(pollfid_t* fids, unsigned int n, timeout_t timeout);
+
+
+/**
+  @brief Operations of @c EventCtl.
+ */
+typedef enum {
+  EVQ_ADD=1,    /**< Add a stream to the event queue */
+  EVQ_MOD=2,    /**< Change the events of interest of a stream */
+  EVQ_DEL=3     /**< Remove a stream from the event queue */
+} evq_op;
+
+
+/** @brief Create an event queue.
+
+  An event queue is a stream which watches other streams, like @c Poll,
+  but persistently: streams are added once, by @c EventCtl, and 
+  @c EventWait returns the streams on which events have occurred.
+  Its cost depends on the number of ready streams, not on the number
+  of streams in the queue, so that a few threads can serve many 
+  mostly idle connections.
+
+  Events are edge-triggered: a stream is returned by @c EventWait once
+  after each change of its state (e.g., when data arrives on a pipe),
+  and not again until the next change. When a stream is added, its 
+  current state counts as a change.
+
+  The event queue is closed by @c Close, which removes all streams.
+
+  @returns the file id of the event queue, or @c NOFILE on error.
+    Possible errors are:
+    - The maximum number of file ids for the process has been reached.
+  @see EventCtl
+  @see EventWait
+ */
+Fid_t EventQueue();
+
+
+/** @brief Add, change or remove a stream of an event queue.
+
+  With @c EVQ_ADD, stream @c fid is added to the event queue @c evq,
+  for the given @c events (a combination of @c EV_READ and @c EV_WRITE; 
+  @c EV_HUP is always reported). With @c EVQ_MOD, the events of interest
+  of @c fid are changed, and with @c EVQ_DEL, @c fid is removed.
+
+  The event queue refers to the stream, not to @c fid: it does not hold 
+  the stream open, and the stream is removed from the event queue when 
+  it is closed, i.e., when the last fid referring to it is closed. 
+  @c EVQ_MOD and @c EVQ_DEL apply to the stream currently at @c fid.
+
+  @param evq the event queue
+  @param op the operation
+  @param fid the stream
+  @param events the events of interest, for @c EVQ_ADD and @c EVQ_MOD
+  @returns 0 on success, or -1 on error. Possible errors are:
+    - @c evq is not an event queue.
+    - @c fid is not an open stream, or it is an event queue (for @c EVQ_ADD).
+    - @c fid is already in the queue (for @c EVQ_ADD), or it is not
+      in the queue (for @c EVQ_MOD and @c EVQ_DEL).
+    - @c op is not a legal operation.
+ */
+int EventCtl(Fid_t evq, evq_op op, Fid_t fid, int events);
+
+
+/** @brief Wait for events on the streams of an event queue.
+
+  If no events have occurred since they were last returned, the calling 
+  thread sleeps until one does, or until the timeout expires. Then, up
+  to @c max entries of @c events are filled with the streams that have 
+  events: @c fid and @c events as given to @c EventCtl, and the events
+  that occurred in @c revents. The rest are returned by the next call.
+
+  Many threads may wait on the same event queue; each event is 
+  returned to one of them.
+
+  @param evq the event queue
+  @param events an array of at least @c max entries
+  @param max the maximum number of streams to return
+  @param timeout the time to wait, in msec, as in @c Poll
+  @returns the number of entries filled, 0 if the timeout expired, or 
+    -1 on error. Possible errors are:
+    - @c evq is not an event queue.
+    - @c events is NULL, or @c max is 0.
+ */
+int EventWait(Fid_t evq, pollfid_t* events, unsigned int max, timeout_t timeout);
+
+
 /** @brief Close a file id.
    
 
@@ -489,6 +724,66 @@ int Close(Fid_t fd);
  */
 int Dup2(Fid_t oldfd, Fid_t newfd);
 
+
+/**
+  @brief Flags of a stream, for @c SetFlags.
+ */
+typedef enum {
+  FLAG_NONBLOCK=1,  /**< I/O calls return @c WOULDBLOCK instead of blocking. */
+  FLAG_PACKET=2,    /**< Pipes and sockets carry messages, instead of bytes. */
+  FLAG_REUSEPORT=4  /**< A listening socket may share its port with others. */
+} stream_flags;
+
+
+/**
+  @brief Set the flags of a stream.
+
+  The flags belong to the stream, so they are shared by the file ids
+  that refer to it (e.g., after @c Dup2).
+
+  When @c FLAG_NONBLOCK is set, the calls that would sleep waiting for
+  the stream return @c WOULDBLOCK instead. These are @c Read, @c Write,
+  @c ReadV, @c WriteV and @c Splice (on pipes, sockets and terminals)
+  and @c Accept. Also, @c Read and @c Write on pipes, sockets and 
+  terminals return as soon as they cannot copy more bytes without 
+  waiting, and not when @c size bytes have been copied. A @c Write to
+  a terminal returns when the data is queued, not when it is sent;
+  the queued data is still sent when the system halts.
+  Use @c Poll or an event queue to find out when to try again.
+
+  When @c FLAG_PACKET is set, a pipe or a connected socket preserves 
+  message boundaries: each @c Write (or @c WriteV) is delivered whole
+  by a single @c Read (or @c ReadV), and if the buffer is too small,
+  the rest of the message is discarded. A @c Write of 0 bytes sends
+  nothing, and a message may not be larger than 256 kbytes.
+  - For a pipe, the flag may be set (or cleared) on either end, before 
+    anything is written, and it applies to both ends. The mode changes
+    only when the flag changes on the end that is set, so the flags of
+    the other end may be set without @c FLAG_PACKET.
+  - For sockets, it must be set before @c Listen or @c Connect. A 
+    connection is made only if the listener and the connecting socket
+    agree on the flag, and the socket returned by @c Accept has it.
+    It cannot be changed on a connected socket.
+
+  When @c FLAG_REUSEPORT is set on a socket before @c Listen, the socket
+  may listen on a port together with other sockets that have the flag.
+  Each @c Connect to the port is queued on one of them, picking the
+  listener with the fewest pending requests, in round-robin order 
+  among equals. Requests pending on a listener that is closed fail, 
+  as usual. The flag cannot be changed on a listening socket.
+
+  The call sets all the flags of the stream, replacing the old ones.
+
+  @param fid the stream
+  @param flags a combination of the @c stream_flags
+  @returns 0 on success, or -1 on error. Possible errors are:
+    - @c fid is not an open stream.
+    - @c flags contains an unknown flag.
+    - The stream does not support @c FLAG_PACKET or @c FLAG_REUSEPORT, 
+      or it cannot be changed any more.
+ */
+int SetFlags(Fid_t fid, int flags);
+
 /*******************************************
  *
  * Pipes
@@ -516,8 +811,8 @@ typedef struct pipe_s {
 
 	A pipe is a one-directional buffer accessed via two file ids,
 	one for each end of the buffer. The size of the buffer is 
-	implementation-specific, but can be assumed to be between 4 and 16 
-	kbytes. 
+	implementation-specific, but can be assumed to be at least 4 kbytes.
+	See also @c PipeWithSize. 
 
 	Once a pipe is constructed, it remains operational as long as both
 	ends are open. If the read end is closed, the write end becomes 
@@ -531,6 +826,27 @@ typedef struct pipe_s {
 */
 int Pipe(pipe_t* pipe);
 
+/**
+	@brief Construct and return a pipe, with a given buffer size.
+
+	This is like @c Pipe, except that the buffer of the pipe starts
+	with (at least) @c size bytes. The size is rounded up to a power 
+	of two, between 512 bytes and 256 kbytes. A @c size of 0 gives the
+	default buffer size of @c Pipe.
+
+	The buffer is only allocated when data is first written to the pipe,
+	and it is released while the pipe stays empty. Under sustained
+	load, the buffer may grow beyond @c size.
+
+	@param pipe a pointer to a pipe_t structure for storing the file ids.
+	@param size the requested buffer size in bytes
+	@returns 0 on success, or -1 on error. Possible reasons for error:
+		- the available file ids for the process are exhausted.
+
+	@see Pipe
+*/
+int PipeWithSize(pipe_t* pipe, unsigned int size);
+
 /*******************************************
  *
  * Sockets (local)
@@ -581,13 +897,15 @@ Fid_t Socket(port_t port);
 
 	The socket must be bound to a port, as a result of calling @c Socket.
 	On each port there must be a unique listening socket (although any number
-	of non-listening sockets are allowed).
+	of non-listening sockets are allowed), unless all the listening sockets 
+	of the port have @c FLAG_REUSEPORT (see @c SetFlags).
 
 	@param sock the socket to initialize as a listening socket
 	@returns 0 on success, -1 on error. Possible reasons for error:
 		- the file id is not legal
 		- the socket is not bound to a port
-		- the port bound to the socket is occupied by another listener
+		- the port bound to the socket is occupied by another listener,
+		  and they do not both have @c FLAG_REUSEPORT
 		- the socket has already been initialized
 	@see Socket
  */
@@ -613,6 +931,8 @@ int Listen(Fid_t sock);
 		- the file id is not initialized by @c Listen()
 		- the available file ids for the process are exhausted
 		- while waiting, the listening socket @c lsock was closed
+		- the connecting socket does not agree with @c lsock on @c FLAG_PACKET
+		  (the request is refused)
 
 	@see Connect
 	@see Listen
@@ -645,6 +965,8 @@ Fid_t Accept(Fid_t lsock);
 	   - the given port is illegal.
 	   - the port does not have a listening socket bound to it by @c Listen.
 	   - the timeout has expired without a successful connection.
+	   - the listener refused the connection, because exactly one of
+	     @c sock and the listening socket has @c FLAG_PACKET set.
 */
 int Connect(Fid_t sock, port_t port, timeout_t timeout);
 
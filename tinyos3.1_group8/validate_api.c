@@ -2597,11 +2597,1279 @@ BARE_TEST(dummy_user_test,
 }
 
 
+static int timeout_wheel_thread(int argl, void* args)
+{
+	return do_timeout(argl, args);
+}
+
+BOOT_TEST(test_many_concurrent_timeouts,
+	"Test that many threads with interleaved timeouts, spanning several timer wheel levels, wake up on time."
+	)
+{
+	const int N = 40;
+	timeout_t T[N];
+	Tid_t tid[N];
+
+	/* Timeouts from 200 msec to about 1.4 sec, in a scrambled order */
+	for(int i=0; i<N; i++) {
+		T[i] = 200 + ((i*17) % N) * 30;
+		tid[i] = CreateThread(timeout_wheel_thread, sizeof(timeout_t), &T[i]);
+		ASSERT(tid[i]!=NOTHREAD);
+	}
+
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tid[i], NULL)==0);
+	return 0;
+}
+
+
+/* Use about 'argl' bytes of stack, and return argl */
+static int stack_user_thread(int argl, void* args)
+{
+	volatile char buf[4096];
+	buf[0] = 1;
+	if(argl > (int)sizeof(buf))
+		return sizeof(buf) + stack_user_thread(argl - sizeof(buf), args) + buf[0] - 1;
+	return argl + buf[0] - 1;
+}
+
+BOOT_TEST(test_create_thread_with_stack,
+	"Test that threads can be created with a given stack size, and can use all of their stack."
+	)
+{
+	unsigned int sizes[] = { 0, 1, 16*1024, 200*1024, 4*1024*1024, 64*1024*1024 };
+	int N = sizeof(sizes)/sizeof(sizes[0]);
+
+	for(int i=0; i<N; i++) {
+		/* Leave room for frame overheads and interrupt handling */
+		int use = (sizes[i] < 64*1024) ? 4*1024 : sizes[i] / 2;
+		Tid_t t = CreateThreadWithStack(stack_user_thread, use, NULL, sizes[i]);
+		ASSERT(t != NOTHREAD);
+		int exitval;
+		ASSERT(ThreadJoin(t, &exitval)==0);
+		ASSERT(exitval == use);
+	}
+	return 0;
+}
+
+
+static int small_stack_thread(int argl, void* args)
+{
+	return argl;
+}
+
+BOOT_TEST(test_many_small_stack_threads,
+	"Test that a large number of threads with small stacks can be created and joined."
+	)
+{
+	const int N = 2000;
+	Tid_t* tids = malloc(N*sizeof(Tid_t));
+
+	for(int i=0; i<N; i++) {
+		tids[i] = CreateThreadWithStack(small_stack_thread, i, NULL, 16*1024);
+		ASSERT(tids[i] != NOTHREAD);
+	}
+	for(int i=0; i<N; i++) {
+		int exitval;
+		ASSERT(ThreadJoin(tids[i], &exitval)==0);
+		ASSERT(exitval == i);
+	}
+	free(tids);
+	return 0;
+}
+
+
+static Mutex contended_mx = MUTEX_INIT;
+static volatile int contended_counter;
+
+static int contended_mutex_thread(int argl, void* args)
+{
+	for(int i=0; i<argl; i++) {
+		Mutex_Lock(&contended_mx);
+		int c = contended_counter;
+		/* Stay in the critical section for a while */
+		for(volatile int k=0; k<200; k++);
+		contended_counter = c+1;
+		Mutex_Unlock(&contended_mx);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_mutex_contention,
+	"Test that a mutex contended by many threads provides mutual exclusion, and that no waiter is lost."
+	)
+{
+	const int N = 20, M = 2000;
+	Tid_t tid[N];
+
+	contended_counter = 0;
+	for(int i=0; i<N; i++)
+		tid[i] = CreateThread(contended_mutex_thread, M, NULL);
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tid[i], NULL)==0);
+
+	ASSERT(contended_counter == N*M);
+	ASSERT(contended_mx == MUTEX_INIT);
+	return 0;
+}
+
+
+
+static int pump_writer(int argl, void* args)
+{
+	char buf[1000];
+	for(int i=0; i<64; i++) {
+		memset(buf, i, sizeof(buf));
+		if(Write(argl, buf, sizeof(buf))!=sizeof(buf)) return 1;
+	}
+	Close(argl);
+	return 0;
+}
+
+static int pump_process(int argl, void* args)
+{
+	pipe_t p;
+	char buf[1000];
+	int exitval;
+
+	if(Pipe(&p)!=0) return 1;
+	Tid_t t = CreateThread(pump_writer, p.write, NULL);
+
+	int total = 0, n;
+	while((n = Read(p.read, buf, sizeof(buf))) > 0) {
+		for(int i=0; i<n; i++)
+			if(buf[i] != (char)((total+i)/1000)) return 2;
+		total += n;
+	}
+
+	if(ThreadJoin(t, &exitval)!=0 || exitval!=0) return 3;
+	return (total == 64*1000) ? 0 : 4;
+}
+
+static int exit_with_argl(int argl, void* args)
+{
+	return argl;
+}
+
+BOOT_TEST(test_parallel_pipes_and_exec,
+	"Test that processes doing pipe I/O and a process doing Exec and WaitChild run concurrently and correctly."
+	)
+{
+	const int N = 4;
+	Pid_t pump[N];
+
+	for(int i=0; i<N; i++)
+		ASSERT((pump[i] = Exec(pump_process, 0, NULL)) != NOPROC);
+
+	for(int i=0; i<200; i++) {
+		int status;
+		Pid_t pid = Exec(exit_with_argl, i, NULL);
+		ASSERT(pid != NOPROC);
+		ASSERT(WaitChild(pid, &status) == pid);
+		ASSERT(status == i);
+	}
+
+	for(int i=0; i<N; i++) {
+		int status;
+		ASSERT(WaitChild(pump[i], &status) == pump[i]);
+		ASSERT(status == 0);
+	}
+	return 0;
+}
+
+
+
+static int ring_writer(int argl, void* args)
+{
+	/* Write a counting pattern in chunks of odd sizes */
+	char buf[997];
+	unsigned int c = 0;
+	for(int k=0; k<1000; k++) {
+		unsigned int n = 1 + (k*131) % sizeof(buf);
+		for(unsigned int i=0; i<n; i++) buf[i] = (char)(c++ % 251);
+		if(Write(argl, buf, n) != n) return 1;
+	}
+	Close(argl);
+	return 0;
+}
+
+BOOT_TEST(test_pipe_ring_wraparound,
+	"Test that data crosses the pipe ring intact, for reads and writes of odd sizes that wrap around it."
+	)
+{
+	pipe_t p;
+	char buf[1231];
+	int exitval;
+
+	ASSERT(Pipe(&p)==0);
+	Tid_t t = CreateThread(ring_writer, p.write, NULL);
+
+	unsigned int c = 0;
+	int n;
+	while((n = Read(p.read, buf, 1 + c % sizeof(buf))) > 0) {
+		for(int i=0; i<n; i++)
+			ASSERT(buf[i] == (char)((c+i) % 251));
+		c += n;
+	}
+	ASSERT(n == 0);
+
+	unsigned int total = 0;
+	for(int k=0; k<1000; k++) total += 1 + (k*131) % 997;
+	ASSERT(c == total);
+
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval == 0);
+	return 0;
+}
+
+
+
+static int sized_pipe_writer(int argl, void* args)
+{
+	/* Large writes, that the reader drains in small reads */
+	static char buf[40000];
+	unsigned int c = 0;
+	for(int k=0; k<20; k++) {
+		for(unsigned int i=0; i<sizeof(buf); i++) buf[i] = (char)(c++ % 253);
+		if(Write(argl, buf, sizeof(buf)) != sizeof(buf)) return 1;
+	}
+	Close(argl);
+	return 0;
+}
+
+BOOT_TEST(test_pipe_with_size,
+	"Test that PipeWithSize creates working pipes, whose buffers grow, shrink and are released as needed."
+	)
+{
+	unsigned int sizes[] = { 0, 1, 512, 3000, 1<<20 };
+
+	for(unsigned int s=0; s<sizeof(sizes)/sizeof(sizes[0]); s++) {
+		pipe_t p;
+		char buf[777];
+		int exitval;
+
+		ASSERT(PipeWithSize(&p, sizes[s])==0);
+		Tid_t t = CreateThread(sized_pipe_writer, p.write, NULL);
+
+		unsigned int c = 0;
+		int n;
+		while((n = Read(p.read, buf, sizeof(buf))) > 0) {
+			for(int i=0; i<n; i++)
+				ASSERT(buf[i] == (char)((c+i) % 253));
+			c += n;
+		}
+		ASSERT(c == 20*40000);
+		ASSERT(ThreadJoin(t, &exitval)==0);
+		ASSERT(exitval == 0);
+		ASSERT(Close(p.read)==0);
+	}
+	return 0;
+}
+
+
+
+static char handoff_buffer[200000];
+
+static int handoff_reader(int argl, void* args)
+{
+	/* One large read, which blocks and receives most data directly */
+	if(Read(argl, handoff_buffer, sizeof(handoff_buffer)) != sizeof(handoff_buffer)) return 1;
+	for(unsigned int i=0; i<sizeof(handoff_buffer); i++)
+		if(handoff_buffer[i] != (char)(i % 241)) return 2;
+	return 0;
+}
+
+BOOT_TEST(test_socket_handoff_transfer,
+	"Test that a large read on a socket, blocked while the peer writes, receives all data in order."
+	)
+{
+	Fid_t lsock, sock1, sock2;
+	char buf[3000];
+	int exitval;
+
+	lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	sock1 = Socket(NOPORT);
+	connect_sockets(sock1, lsock, &sock2, 100);
+
+	Tid_t t = CreateThread(handoff_reader, sock2, NULL);
+
+	unsigned int c = 0;
+	for(int k=0; c < sizeof(handoff_buffer); k++) {
+		unsigned int n = 1 + (k*577) % sizeof(buf);
+		if(n > sizeof(handoff_buffer) - c) n = sizeof(handoff_buffer) - c;
+		for(unsigned int i=0; i<n; i++) buf[i] = (char)((c+i) % 241);
+		ASSERT(Write(sock1, buf, n) == n);
+		c += n;
+	}
+
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval == 0);
+
+	/* The stream still works afterwards, and ends on close */
+	check_transfer(sock1, sock2);
+	ASSERT(Close(sock1)==0);
+	ASSERT(Read(sock2, buf, sizeof(buf))==0);
+	return 0;
+}
+
+
+
+static int splice_source(int argl, void* args)
+{
+	char buf[1000];
+	for(int k=0; k<50; k++) {
+		for(int i=0; i<1000; i++) buf[i] = (char)((k*1000+i) % 239);
+		if(Write(argl, buf, 1000) != 1000) return 1;
+	}
+	Close(argl);
+	return 0;
+}
+
+static int splice_sink(int argl, void* args)
+{
+	char buf[1500];
+	int n, c = 0;
+	while((n = Read(argl, buf, sizeof(buf))) > 0) {
+		for(int i=0; i<n; i++)
+			if(buf[i] != (char)((c+i) % 239)) return 1;
+		c += n;
+	}
+	return (c == 50000) ? 0 : 2;
+}
+
+BOOT_TEST(test_splice,
+	"Test that Splice moves data between pipes, sockets and other streams."
+	)
+{
+	pipe_t p1, p2;
+	int exitval;
+
+	/* pipe -> socket -> pipe, through two splices */
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	Fid_t sock1 = Socket(NOPORT), sock2;
+	connect_sockets(sock1, lsock, &sock2, 100);
+
+	ASSERT(Pipe(&p1)==0);
+	ASSERT(Pipe(&p2)==0);
+	Tid_t src = CreateThread(splice_source, p1.write, NULL);
+	Tid_t dst = CreateThread(splice_sink, p2.read, NULL);
+
+	int n, total = 0;
+	while((n = Splice(p1.read, sock1, 4096)) > 0) {
+		total += n;
+		ASSERT(Splice(sock2, p2.write, n) == n);
+	}
+	ASSERT(n == 0);
+	ASSERT(total == 50000);
+	ASSERT(Close(p2.write)==0);
+
+	ASSERT(ThreadJoin(src, &exitval)==0 && exitval==0);
+	ASSERT(ThreadJoin(dst, &exitval)==0 && exitval==0);
+
+	/* The null device has no Splice method */
+	char buf[100];
+	Fid_t nul = OpenNull();
+	ASSERT(Splice(nul, sock1, 100) == 100);
+	ASSERT(Read(sock2, buf, 100) == 100);
+	for(int i=0; i<100; i++) ASSERT(buf[i]==0);
+
+	/* Errors */
+	ASSERT(Splice(NOFILE, sock1, 10) == -1);
+	ASSERT(Splice(nul, MAX_FILEID, 10) == -1);
+	ASSERT(Splice(p1.read, p2.read, 10) == -1);
+
+	/* A pipe or a connection cannot be spliced into itself */
+	pipe_t p3;
+	ASSERT(Pipe(&p3)==0);
+	ASSERT(Write(p3.write, "loop", 4)==4);
+	ASSERT(Splice(p3.read, p3.write, 10) == -1);
+	ASSERT(Write(sock1, "loop", 4)==4);
+	ASSERT(Splice(sock2, sock1, 10) == -1);
+	ASSERT(Splice(sock2, sock2, 4) == 4);
+	ASSERT(Read(sock1, buf, 4) == 4 && memcmp(buf, "loop", 4) == 0);
+	return 0;
+}
+
+
+
+static char readv_payload[60000];
+
+static int readv_reader(int argl, void* args)
+{
+	/* Read records of a header and a payload, in odd sized pieces */
+	static char body[60000];
+	int len;
+	for(int k=0; k<10; k++) {
+		iovec_t hdr[2] = { { &len, 1 }, { ((char*)&len)+1, sizeof(len)-1 } };
+		if(ReadV(argl, hdr, 2) != sizeof(len)) return 1;
+		if(len != sizeof(readv_payload)-k) return 2;
+		int c = 0;
+		while(c < len) {
+			iovec_t iov[3] = { { body+c, 1 }, { NULL, 0 }, { body+c+1, len-c-1 } };
+			int n = ReadV(argl, iov, (len-c>1) ? 3 : 1);
+			if(n <= 0) return 3;
+			c += n;
+		}
+		if(memcmp(body, readv_payload, len) != 0) return 4;
+	}
+	return 0;
+}
+
+BOOT_TEST(test_readv_writev,
+	"Test that ReadV and WriteV move data in the order of the buffers, on pipes, sockets and other streams."
+	)
+{
+	pipe_t p;
+	int exitval;
+	char buf[100];
+
+	for(unsigned int i=0; i<sizeof(readv_payload); i++) 
+		readv_payload[i] = (char)(i % 251);
+
+	ASSERT(Pipe(&p)==0);
+
+	/* Header and payload in one call, larger than the pipe buffer */
+	Tid_t t = CreateThread(readv_reader, p.read, NULL);
+	for(int k=0; k<10; k++) {
+		int len = sizeof(readv_payload)-k;
+		iovec_t msg[2] = { { &len, sizeof(len) }, { readv_payload, len } };
+		ASSERT(WriteV(p.write, msg, 2) == sizeof(len)+len);
+	}
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval==0);
+
+	/* Sockets */
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	Fid_t sock1 = Socket(NOPORT), sock2;
+	connect_sockets(sock1, lsock, &sock2, 100);
+
+	iovec_t out[3] = { { "Hello", 5 }, { ", ", 2 }, { "world", 5 } };
+	ASSERT(WriteV(sock1, out, 3) == 12);
+	iovec_t in[2] = { { buf, 7 }, { buf+50, 5 } };
+	ASSERT(ReadV(sock2, in, 2) == 12);
+	ASSERT(memcmp(buf, "Hello, ", 7)==0);
+	ASSERT(memcmp(buf+50, "world", 5)==0);
+
+	/* End of stream */
+	ASSERT(ShutDown(sock1, SHUTDOWN_WRITE)==0);
+	ASSERT(ReadV(sock2, in, 2) == 0);
+
+	/* The null device has no vectored methods */
+	Fid_t nul = OpenNull();
+	memset(buf, 1, sizeof(buf));
+	ASSERT(ReadV(nul, in, 2) == 12);
+	for(int i=0; i<7; i++) ASSERT(buf[i]==0);
+	for(int i=50; i<55; i++) ASSERT(buf[i]==0);
+	ASSERT(buf[7]==1);
+	ASSERT(WriteV(nul, out, 3) == 12);
+
+	/* Empty vectors and errors */
+	ASSERT(WriteV(p.write, NULL, 0) == 0);
+	ASSERT(ReadV(p.read, NULL, 0) == 0);
+	ASSERT(WriteV(p.write, NULL, 2) == -1);
+	ASSERT(ReadV(NOFILE, in, 2) == -1);
+	ASSERT(WriteV(p.read, out, 3) == -1);
+	ASSERT(ReadV(p.write, in, 2) == -1);
+	return 0;
+}
+
+
+
+#define POLL_PIPES 6
+
+static int poll_writer(int argl, void* args)
+{
+	/* argl is the write end, records of 8 bytes */
+	char rec[8];
+	for(int k=0; k<100; k++) {
+		memset(rec, 'a'+k%26, sizeof(rec));
+		if(Write(argl, rec, sizeof(rec)) != sizeof(rec)) return 1;
+	}
+	Close(argl);
+	return 0;
+}
+
+static int poll_connector(int argl, void* args)
+{
+	Fid_t sock = Socket(NOPORT);
+	return Connect(sock, argl, 1000);
+}
+
+BOOT_TEST(test_poll,
+	"Test that Poll lets one thread serve many pipes and sockets, and reports readiness correctly."
+	)
+{
+	pollfid_t fids[POLL_PIPES+1];
+	Tid_t t[POLL_PIPES];
+	int count[POLL_PIPES] = {0};
+	char rec[8];
+	int exitval;
+
+	/* One thread reads records from many pipes */
+	for(int i=0; i<POLL_PIPES; i++) {
+		pipe_t p;
+		ASSERT(Pipe(&p)==0);
+		fids[i].fid = p.read;
+		fids[i].events = EV_READ;
+		t[i] = CreateThread(poll_writer, p.write, NULL);  /* closes p.write */
+	}
+	fids[POLL_PIPES].fid = NOFILE;   /* ignored */
+	fids[POLL_PIPES].events = EV_READ;
+
+	int open = POLL_PIPES;
+	while(open > 0) {
+		int n = Poll(fids, POLL_PIPES+1, (timeout_t)-1);
+		ASSERT(n > 0);
+		ASSERT(fids[POLL_PIPES].revents == 0);
+		for(int i=0; i<POLL_PIPES; i++) {
+			if(fids[i].revents == 0) continue;
+			n--;
+			ASSERT(fids[i].revents & EV_READ);
+			int rc = Read(fids[i].fid, rec, sizeof(rec));
+			if(rc == 0) {
+				ASSERT(fids[i].revents & EV_HUP);
+				ASSERT(Close(fids[i].fid)==0);
+				fids[i].fid = NOFILE;
+				open--;
+				continue;
+			}
+			ASSERT(rc == sizeof(rec));
+			ASSERT(rec[0] == 'a'+count[i]%26);
+			count[i]++;
+		}
+		ASSERT(n == 0);
+	}
+	for(int i=0; i<POLL_PIPES; i++) {
+		ASSERT(count[i] == 100);
+		ASSERT(ThreadJoin(t[i], &exitval)==0 && exitval==0);
+	}
+
+	/* Readiness of both ends, and timeouts */
+	pipe_t p;
+	ASSERT(PipeWithSize(&p, 512)==0);
+	pollfid_t pf[2] = { { p.read, EV_READ|EV_WRITE, 0 }, { p.write, EV_READ|EV_WRITE, 0 } };
+	ASSERT(Poll(pf, 2, 0) == 1);
+	ASSERT(pf[0].revents == 0 && pf[1].revents == EV_WRITE);
+	pf[1].events = EV_READ;
+	ASSERT(Poll(pf, 2, 50) == 0);
+
+	char buf[512];
+	memset(buf, 0, sizeof(buf));
+	ASSERT(Write(p.write, buf, sizeof(buf)) == sizeof(buf));
+	pf[1].events = EV_WRITE;
+	ASSERT(Poll(pf, 2, 0) == 1);
+	ASSERT(pf[0].revents == EV_READ && pf[1].revents == 0);
+	ASSERT(Read(p.read, buf, sizeof(buf)) == sizeof(buf));
+	ASSERT(Poll(pf, 2, 0) == 1);
+	ASSERT(pf[0].revents == 0 && pf[1].revents == EV_WRITE);
+
+	ASSERT(Close(p.read)==0);
+	ASSERT(Poll(pf, 2, 0) == 2);
+	ASSERT(pf[0].revents == EV_INVAL && pf[1].revents == EV_HUP);
+	ASSERT(Close(p.write)==0);
+
+	/* Listening sockets are readable when Accept will not block */
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	pollfid_t lf = { lsock, EV_READ, 0 };
+	ASSERT(Poll(&lf, 1, 0) == 0);
+	Tid_t c = CreateThread(poll_connector, 100, NULL);
+	ASSERT(Poll(&lf, 1, (timeout_t)-1) == 1);
+	ASSERT(lf.revents == EV_READ);
+	Fid_t sock = Accept(lsock);
+	ASSERT(sock != NOFILE);
+	ASSERT(ThreadJoin(c, &exitval)==0 && exitval==0);
+
+	pollfid_t sf = { sock, EV_READ|EV_WRITE, 0 };
+	ASSERT(Poll(&sf, 1, 0) == 1);
+	ASSERT(sf.revents == EV_WRITE);
+
+	/* Errors */
+	ASSERT(Poll(NULL, 1, 0) == -1);
+	ASSERT(Poll(NULL, 0, 0) == 0);
+	return 0;
+}
+
+
+
+BOOT_TEST(test_event_queue,
+	"Test that an event queue reports edge-triggered events of many streams, in batches."
+	)
+{
+	pollfid_t ev[3];
+	Tid_t t[POLL_PIPES];
+	Fid_t rd[POLL_PIPES];
+	int count[POLL_PIPES] = {0};
+	char rec[8];
+	int exitval;
+
+	Fid_t evq = EventQueue();
+	ASSERT(evq != NOFILE);
+
+	/* The writers of test_poll, served with batches of 3 events */
+	for(int i=0; i<POLL_PIPES; i++) {
+		pipe_t p;
+		ASSERT(Pipe(&p)==0);
+		rd[i] = p.read;
+		ASSERT(EventCtl(evq, EVQ_ADD, p.read, EV_READ)==0);
+		t[i] = CreateThread(poll_writer, p.write, NULL);
+	}
+
+	int open = POLL_PIPES;
+	while(open > 0) {
+		int n = EventWait(evq, ev, 3, (timeout_t)-1);
+		ASSERT(n > 0 && n <= 3);
+		for(int k=0; k<n; k++) {
+			int i = 0;
+			while(rd[i] != ev[k].fid) i++;
+			ASSERT(ev[k].events == EV_READ);
+			ASSERT(ev[k].revents & EV_READ);
+
+			/* Drain the records that are there, the event is not repeated */
+			pollfid_t pf = { ev[k].fid, EV_READ, 0 };
+			while(Poll(&pf, 1, 0) == 1) {
+				int rc = Read(ev[k].fid, rec, sizeof(rec));
+				if(rc == 0) {
+					ASSERT(pf.revents & EV_HUP);
+					ASSERT(EventCtl(evq, EVQ_DEL, ev[k].fid, 0)==0);
+					ASSERT(Close(ev[k].fid)==0);
+					open--;
+					break;
+				}
+				ASSERT(rc == sizeof(rec));
+				ASSERT(rec[0] == 'a'+count[i]%26);
+				count[i]++;
+			}
+		}
+	}
+	for(int i=0; i<POLL_PIPES; i++) {
+		ASSERT(count[i] == 100);
+		ASSERT(ThreadJoin(t[i], &exitval)==0 && exitval==0);
+	}
+	ASSERT(EventWait(evq, ev, 3, 0) == 0);
+
+	/* Edge-triggered: the data that is already there is reported once */
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	ASSERT(Write(p.write, "0123456789", 10)==10);
+	ASSERT(EventCtl(evq, EVQ_ADD, p.read, EV_READ)==0);
+	ASSERT(EventCtl(evq, EVQ_ADD, p.write, EV_READ)==0);
+	ASSERT(EventWait(evq, ev, 3, 0) == 1);
+	ASSERT(ev[0].fid == p.read && ev[0].revents == EV_READ);
+	ASSERT(EventWait(evq, ev, 3, 50) == 0);
+	ASSERT(Write(p.write, "0123456789", 10)==10);
+	ASSERT(EventWait(evq, ev, 3, 0) == 1);
+	ASSERT(ev[0].fid == p.read);
+
+	/* Changing the events counts as a change */
+	ASSERT(EventCtl(evq, EVQ_MOD, p.write, EV_WRITE)==0);
+	ASSERT(EventWait(evq, ev, 3, 0) == 1);
+	ASSERT(ev[0].fid == p.write && ev[0].revents == EV_WRITE);
+
+	/* Listening sockets */
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	ASSERT(EventCtl(evq, EVQ_ADD, lsock, EV_READ)==0);
+	Tid_t c = CreateThread(poll_connector, 100, NULL);
+	ASSERT(EventWait(evq, ev, 3, (timeout_t)-1) == 1);
+	ASSERT(ev[0].fid == lsock && ev[0].revents == EV_READ);
+	ASSERT(Accept(lsock) != NOFILE);
+	ASSERT(ThreadJoin(c, &exitval)==0 && exitval==0);
+
+	/* Errors */
+	ASSERT(EventCtl(evq, EVQ_ADD, p.read, EV_READ)==-1);
+	ASSERT(EventCtl(evq, EVQ_ADD, evq, EV_READ)==-1);
+	ASSERT(EventCtl(evq, EVQ_ADD, NOFILE, EV_READ)==-1);
+	ASSERT(EventCtl(evq, EVQ_DEL, NOFILE, 0)==-1);
+	ASSERT(EventCtl(evq, EVQ_MOD, 15, EV_READ)==-1);
+	ASSERT(EventCtl(p.read, EVQ_ADD, p.write, EV_READ)==-1);
+	ASSERT(EventWait(p.read, ev, 3, 0)==-1);
+	ASSERT(EventWait(evq, NULL, 3, 0)==-1);
+	ASSERT(EventWait(evq, ev, 0, 0)==-1);
+
+	/* Closing the queue releases the streams */
+	ASSERT(Close(evq)==0);
+	ASSERT(Close(p.write)==0);
+	char buf[20];
+	ASSERT(Read(p.read, buf, 20) == 20);
+	ASSERT(Read(p.read, buf, 20) == 0);
+	return 0;
+}
+
+
+BOOT_TEST(test_event_queue_close,
+	"Test that an event queue does not hold its streams open, and forgets them when they are closed."
+	)
+{
+	pollfid_t ev[3];
+	pipe_t p, q;
+	char buf[3];
+
+	Fid_t evq = EventQueue();
+	ASSERT(evq != NOFILE);
+
+	/* Closing the read end closes the pipe, the writer sees it */
+	ASSERT(Pipe(&p)==0);
+	ASSERT(EventCtl(evq, EVQ_ADD, p.read, EV_READ)==0);
+	ASSERT(Close(p.read)==0);
+	ASSERT(Write(p.write, "abc", 3)==-1);
+	ASSERT(EventCtl(evq, EVQ_DEL, p.read, 0)==-1);
+	ASSERT(Close(p.write)==0);
+
+	/* A new stream at the same fid is not in the queue */
+	ASSERT(Pipe(&q)==0);
+	ASSERT(q.read == p.read);
+	ASSERT(EventCtl(evq, EVQ_MOD, q.read, EV_READ)==-1);
+	ASSERT(EventCtl(evq, EVQ_DEL, q.read, 0)==-1);
+	ASSERT(EventCtl(evq, EVQ_ADD, q.read, EV_READ)==0);
+
+	/* The stream stays in the queue while another fid refers to it */
+	Fid_t other = q.write + 1;
+	ASSERT(Dup2(q.read, other)==0);
+	ASSERT(Close(q.read)==0);
+	ASSERT(Write(q.write, "abc", 3)==3);
+	ASSERT(EventWait(evq, ev, 3, 0)==1);
+	ASSERT(ev[0].fid == q.read && ev[0].revents == EV_READ);
+	ASSERT(Read(other, buf, 3)==3);
+
+	/* ... and leaves it when the last one is closed */
+	ASSERT(Close(other)==0);
+	ASSERT(Write(q.write, "abc", 3)==-1);
+	ASSERT(EventWait(evq, ev, 3, 0)==0);
+	ASSERT(Close(q.write)==0);
+	ASSERT(Close(evq)==0);
+	return 0;
+}
+
+
+
+BOOT_TEST(test_nonblocking_streams,
+	"Test that non-blocking pipes and sockets return WOULDBLOCK instead of sleeping."
+	)
+{
+	char buf[1000];
+	int exitval;
+
+	/* Reading */
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	ASSERT(SetFlags(p.read, FLAG_NONBLOCK)==0);
+	ASSERT(Read(p.read, buf, 100) == WOULDBLOCK);
+	iovec_t iov = { buf, 100 };
+	ASSERT(ReadV(p.read, &iov, 1) == WOULDBLOCK);
+	ASSERT(Splice(p.read, OpenNull(), 100) == WOULDBLOCK);
+	ASSERT(Write(p.write, "hello", 5) == 5);
+	ASSERT(Read(p.read, buf, 100) == 5);   /* not 100 */
+	ASSERT(memcmp(buf, "hello", 5)==0);
+	ASSERT(Read(p.read, buf, 100) == WOULDBLOCK);
+
+	/* The flags belong to the stream */
+	ASSERT(Dup2(p.read, 10)==0);
+	ASSERT(Read(10, buf, 100) == WOULDBLOCK);
+	ASSERT(Close(10)==0);
+
+	ASSERT(Write(p.write, "bye", 3) == 3);
+	ASSERT(Close(p.write)==0);
+	ASSERT(Read(p.read, buf, 100) == 3);
+	ASSERT(Read(p.read, buf, 100) == 0);
+	ASSERT(Close(p.read)==0);
+
+	/* Writing */
+	ASSERT(PipeWithSize(&p, 512)==0);
+	ASSERT(SetFlags(p.write, FLAG_NONBLOCK)==0);
+	memset(buf, 'x', sizeof(buf));
+	ASSERT(Write(p.write, buf, 1000) == 512);
+	ASSERT(Write(p.write, buf, 1000) == WOULDBLOCK);
+	ASSERT(Read(p.read, buf, 100) == 100);
+	ASSERT(Write(p.write, buf, 1000) == 100);
+	ASSERT(SetFlags(p.write, 0)==0);
+	ASSERT(Close(p.read)==0);
+	ASSERT(Write(p.write, buf, 1000) == -1);
+	ASSERT(Close(p.write)==0);
+
+	/* Accept */
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	ASSERT(SetFlags(lsock, FLAG_NONBLOCK)==0);
+	ASSERT(Accept(lsock) == WOULDBLOCK);
+	Tid_t c = CreateThread(poll_connector, 100, NULL);
+	pollfid_t lf = { lsock, EV_READ, 0 };
+	ASSERT(Poll(&lf, 1, (timeout_t)-1) == 1);
+	Fid_t sock = Accept(lsock);
+	ASSERT(sock >= 0);
+	ASSERT(ThreadJoin(c, &exitval)==0 && exitval==0);
+
+	/* Sockets */
+	ASSERT(SetFlags(sock, FLAG_NONBLOCK)==0);
+	ASSERT(Read(sock, buf, 100) == WOULDBLOCK);
+	ASSERT(Write(sock, "ping", 4) == 4);
+	ASSERT(ShutDown(sock, SHUTDOWN_READ)==0);
+	ASSERT(Read(sock, buf, 100) == -1);
+
+	/* Errors */
+	ASSERT(SetFlags(NOFILE, FLAG_NONBLOCK)==-1);
+	ASSERT(SetFlags(sock, 1024)==-1);
+	return 0;
+}
+
+
+
+static char packet_buffer[100001];
+
+static unsigned int packet_size(int k) { return 1 + (k*7919) % 100000; }
+
+static int packet_writer(int argl, void* args)
+{
+	for(int k=0; k<40; k++) {
+		unsigned int n = packet_size(k);
+		memset(packet_buffer, 'a'+k%26, n);
+		if(Write(argl, packet_buffer, n) != n) return 1;
+	}
+	Close(argl);
+	return 0;
+}
+
+BOOT_TEST(test_packet_mode,
+	"Test that pipes and sockets with FLAG_PACKET deliver each write with one read."
+	)
+{
+	static char buf[100001];
+	pipe_t p, q;
+	int exitval;
+
+	ASSERT(Pipe(&p)==0);
+	ASSERT(SetFlags(p.write, FLAG_PACKET)==0);
+	ASSERT(Write(p.write, "hello", 5)==5);
+	ASSERT(Write(p.write, "world!!", 7)==7);
+	iovec_t out[3] = { { "a", 1 }, { "bc", 2 }, { "def", 3 } };
+	ASSERT(WriteV(p.write, out, 3)==6);
+	ASSERT(Write(p.write, "", 0)==0);
+	ASSERT(Write(p.write, "0123456789", 10)==10);
+	ASSERT(Write(p.write, "x", 1)==1);
+
+	ASSERT(Read(p.read, buf, 100)==5);
+	ASSERT(memcmp(buf, "hello", 5)==0);
+	ASSERT(Read(p.read, buf, 100)==7);
+	ASSERT(memcmp(buf, "world!!", 7)==0);
+	iovec_t in[2] = { { buf, 2 }, { buf+50, 50 } };
+	ASSERT(ReadV(p.read, in, 2)==6);
+	ASSERT(memcmp(buf, "ab", 2)==0 && memcmp(buf+50, "cdef", 4)==0);
+	ASSERT(Read(p.read, buf, 4)==4);   /* the rest is dropped */
+	ASSERT(Read(p.read, buf, 100)==1 && buf[0]=='x');
+
+	/* The mode is fixed after the first write */
+	ASSERT(SetFlags(p.write, 0)==-1);
+	ASSERT(SetFlags(p.read, FLAG_NONBLOCK)==0);
+	ASSERT(Write(p.write, "ab", 2)==2 && Write(p.write, "cd", 2)==2);
+	ASSERT(Read(p.read, buf, 100)==2 && Read(p.read, buf, 100)==2);
+	ASSERT(SetFlags(p.read, FLAG_PACKET|FLAG_NONBLOCK)==0);
+	ASSERT(SetFlags(p.read, FLAG_NONBLOCK)==-1);
+	ASSERT(Read(p.read, buf, 100)==WOULDBLOCK);
+	ASSERT(SetFlags(p.read, FLAG_PACKET)==0);
+
+	/* Large messages grow the pipe, and arrive whole */
+	ASSERT(Write(p.write, buf, 300000)==-1);
+	Tid_t t = CreateThread(packet_writer, p.write, NULL);
+	for(int k=0; k<40; k++) {
+		unsigned int n = packet_size(k);
+		ASSERT(Read(p.read, buf, sizeof(buf))==n);
+		for(unsigned int i=0; i<n; i++) ASSERT(buf[i]=='a'+k%26);
+	}
+	ASSERT(Read(p.read, buf, sizeof(buf))==0);
+	ASSERT(ThreadJoin(t, &exitval)==0 && exitval==0);
+	ASSERT(Close(p.read)==0);
+
+	/* Splice moves one message */
+	ASSERT(Pipe(&p)==0);
+	ASSERT(Pipe(&q)==0);
+	ASSERT(SetFlags(p.read, FLAG_PACKET)==0);
+	ASSERT(SetFlags(q.write, FLAG_PACKET)==0);
+	ASSERT(Write(p.write, "first", 5)==5);
+	ASSERT(Write(p.write, "second", 6)==6);
+	ASSERT(Splice(p.read, q.write, 100)==5);
+	ASSERT(Splice(p.read, q.write, 100)==6);
+	ASSERT(Read(q.read, buf, 100)==5);
+	ASSERT(Read(q.read, buf, 100)==6);
+
+	/* Sockets */
+	Fid_t lsock = Socket(100);
+	ASSERT(SetFlags(lsock, FLAG_PACKET)==0);
+	ASSERT(Listen(lsock)==0);
+	Fid_t sock1 = Socket(NOPORT), sock2;
+	ASSERT(SetFlags(sock1, FLAG_PACKET)==0);
+	connect_sockets(sock1, lsock, &sock2, 100);
+	ASSERT(Write(sock1, "ping", 4)==4);
+	ASSERT(Write(sock1, "pong", 4)==4);
+	ASSERT(Read(sock2, buf, 100)==4);
+	ASSERT(Write(sock2, "reply", 5)==5);
+	ASSERT(Read(sock1, buf, 100)==5);
+	ASSERT(Read(sock2, buf, 100)==4);
+	ASSERT(SetFlags(sock2, 0)==-1);
+	ASSERT(SetFlags(sock2, FLAG_PACKET|FLAG_NONBLOCK)==0);
+	ASSERT(Read(sock2, buf, 100)==WOULDBLOCK);
+
+	/* A stream socket cannot connect to a packet listener */
+	Tid_t c = CreateThread(poll_connector, 100, NULL);
+	ASSERT(Accept(lsock)==NOFILE);
+	ASSERT(ThreadJoin(c, &exitval)==0 && exitval==-1);
+
+	/* Streams without packet mode */
+	ASSERT(SetFlags(OpenNull(), FLAG_PACKET)==-1);
+	return 0;
+}
+
+
+
+static int reuseport_connector(int argl, void* args)
+{
+	Fid_t sock = Socket(NOPORT);
+	int rc = Connect(sock, argl, 1000);
+	Close(sock);
+	return rc;
+}
+
+BOOT_TEST(test_reuseport,
+	"Test that listeners with FLAG_REUSEPORT share a port and its connections."
+	)
+{
+	Fid_t lsock[3];
+	pollfid_t fids[3];
+	int count[3] = {0};
+	Tid_t t[6];
+	int exitval;
+
+	/* Every listener of the port must have the flag */
+	for(int i=0; i<3; i++) {
+		lsock[i] = Socket(100);
+		ASSERT(SetFlags(lsock[i], FLAG_REUSEPORT)==0);
+		ASSERT(Listen(lsock[i])==0);
+		fids[i] = (pollfid_t){ lsock[i], EV_READ, 0 };
+	}
+	Fid_t other = Socket(100);
+	ASSERT(Listen(other)==-1);
+	ASSERT(SetFlags(lsock[0], 0)==-1);
+	ASSERT(Close(other)==0);
+
+	/* The first requests go to different listeners */
+	for(int i=0; i<6; i++)
+		t[i] = CreateThread(reuseport_connector, 100, NULL);
+	int accepted = 0;
+	while(accepted < 6) {
+		ASSERT(Poll(fids, 3, (timeout_t)-1) > 0);
+		for(int i=0; i<3; i++)
+			if(fids[i].revents & EV_READ) {
+				Fid_t peer = Accept(lsock[i]);
+				ASSERT(peer != NOFILE);
+				ASSERT(Close(peer)==0);
+				count[i]++;
+				accepted++;
+			}
+	}
+	for(int i=0; i<3; i++)
+		ASSERT(count[i] >= 1);
+	for(int i=0; i<6; i++)
+		ASSERT(ThreadJoin(t[i], &exitval)==0 && exitval==0);
+
+	/* A closed listener leaves the port to the others */
+	ASSERT(Close(lsock[0])==0);
+	ASSERT(Close(lsock[2])==0);
+	for(int i=0; i<3; i++) {
+		t[i] = CreateThread(reuseport_connector, 100, NULL);
+		Fid_t peer = Accept(lsock[1]);
+		ASSERT(peer != NOFILE);
+		ASSERT(Close(peer)==0);
+		ASSERT(ThreadJoin(t[i], &exitval)==0 && exitval==0);
+	}
+
+	/* When all are closed, the port is free */
+	ASSERT(Close(lsock[1])==0);
+	ASSERT(reuseport_connector(100, NULL)==-1);
+	other = Socket(100);
+	ASSERT(Listen(other)==0);
+
+	/* Only sockets share ports */
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	ASSERT(SetFlags(p.read, FLAG_REUSEPORT)==-1);
+	return 0;
+}
+
+
+
+static int churn_connector(int argl, void* args)
+{
+	char buf[16];
+	for(int k=0; k<200; k++) {
+		Fid_t sock = Socket(NOPORT);
+		if(SetFlags(sock, (argl==101) ? FLAG_PACKET : 0) != 0) return 1;
+		if(Connect(sock, argl, (timeout_t)-1) != 0) return 2;
+		if(Write(sock, "hello", 5) != 5) return 3;
+		if(Read(sock, buf, 5) != 5 || memcmp(buf, "world", 5) != 0) return 4;
+		Close(sock);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_connection_churn,
+	"Test that many short-lived connections and pipes, which reuse freed objects, work correctly."
+	)
+{
+	char buf[32];
+	int exitval;
+
+	/* Stream connections on port 100, packet connections on port 101 */
+	Fid_t lsock[2] = { Socket(100), Socket(101) };
+	ASSERT(SetFlags(lsock[1], FLAG_PACKET)==0);
+	ASSERT(Listen(lsock[0])==0);
+	ASSERT(Listen(lsock[1])==0);
+
+	Tid_t t[2] = { CreateThread(churn_connector, 100, NULL), CreateThread(churn_connector, 101, NULL) };
+	for(int k=0; k<400; k++) {
+		Fid_t peer = Accept(lsock[k%2]);
+		ASSERT(peer != NOFILE);
+		ASSERT(Read(peer, buf, 5)==5 && memcmp(buf, "hello", 5)==0);
+		ASSERT(Write(peer, "world", 5)==5);
+		ASSERT(Close(peer)==0);
+	}
+	for(int i=0; i<2; i++) {
+		ASSERT(ThreadJoin(t[i], &exitval)==0 && exitval==0);
+		ASSERT(Close(lsock[i])==0);
+	}
+
+	/* Pipes of different sizes, and modes, over the same objects */
+	for(int k=0; k<200; k++) {
+		pipe_t p;
+		ASSERT(((k%3) ? PipeWithSize(&p, 512 << (k%3)) : Pipe(&p))==0);
+		if(k%2) ASSERT(SetFlags(p.write, FLAG_PACKET)==0);
+		ASSERT(Write(p.write, "0123456789", 10)==10);
+		ASSERT(Write(p.write, "abc", 3)==3);
+		ASSERT(Read(p.read, buf, (k%2) ? 32 : 13)==((k%2) ? 10 : 13));
+		ASSERT(Close(p.write)==0);
+		ASSERT(Close(p.read)==0);
+	}
+	return 0;
+}
+
+
+
+static int kbd_burst_sender(int argl, void* args)
+{
+	char message[16];
+	fibo(20);	/* Let the reader go to sleep */
+	sprintf(message, "burst %3d", argl);
+	sendme(0, message);
+	return 0;
+}
+
+BOOT_TEST(test_kbd_bursts,
+	"Test that keyboard input arriving in bursts, while the reader sleeps, wakes up the reader.",
+	.minimum_terminals = 1
+	)
+{
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+
+	for(int k=0; k<100; k++) {
+		char message[16];
+		sprintf(message, "burst %3d", k);
+		Tid_t t = CreateThread(kbd_burst_sender, k, NULL);
+		checked_read(fterm, message);
+		ASSERT(ThreadJoin(t, NULL)==0);
+	}
+	return 0;
+}
+
+
+
+BOOT_TEST(test_kbd_block_reads,
+	"Test that reads of any size from the keyboard see the input in order, across the buffer of the serial port.",
+	.minimum_terminals = 1
+	)
+{
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+
+	/* 20000 bytes, in pieces of 1000 */
+	char piece[1001];
+	for(int k=0; k<20; k++) {
+		for(int i=0; i<1000; i++) piece[i] = 'a' + (k*1000+i) % 23;
+		piece[1000] = '\0';
+		sendme(0, piece);
+	}
+
+	/* Read them in odd sizes; a read may return fewer bytes, if the input runs out */
+	char buf[1000];
+	int total = 0, size = 1;
+	while(total < 20000) {
+		int n = (20000-total < size) ? 20000-total : size;
+		n = Read(fterm, buf, n);
+		ASSERT(n > 0);
+		if(n <= 0) break;
+		for(int i=0; i<n; i++) ASSERT(buf[i] == 'a' + (total+i) % 23);
+		total += n;
+		size = (size * 7 + 3) % 997 + 1;
+	}
+	return 0;
+}
+
+
+static int slow_con_writer(int argl, void* args)
+{
+	Fid_t fterm = *(Fid_t*)args;
+	char buffer[8192];
+	int count = 0;
+	for(int k=0; k<16; k++) {
+		for(int i=0; i<8192; i++) buffer[i] = 'a' + (k*8192+i) % 23;
+		int rc = Write(fterm, buffer, 8192);
+		ASSERT(rc==8192);
+		count += rc;
+	}
+	return count;
+}
+
+BOOT_TEST(test_write_con_slow,
+	"Test that a writer to a terminal that does not keep up sleeps, and is woken up as the terminal drains.",
+	.minimum_terminals = 1
+	)
+{
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+
+	/* Nothing reads the console yet, so the writer must block */
+	Tid_t t = CreateThread(slow_con_writer, sizeof(fterm), &fterm);
+	fibo(30);
+
+	/* Now, drain it */
+	char piece[1025];
+	for(int k=0; k<128; k++) {
+		for(int i=0; i<1024; i++) piece[i] = 'a' + (k*1024+i) % 23;
+		piece[1024] = '\0';
+		expect(0, piece);
+	}
+
+	int count;
+	ASSERT(ThreadJoin(t, &count)==0);
+	ASSERT(count == 16*8192);
+	return 0;
+}
+
+
+BOOT_TEST(test_nonblocking_terminal,
+	"Test that a non-blocking terminal does not sleep, when there is no input or the console is stalled.",
+	.minimum_terminals = 1
+	)
+{
+	char buf[8192];
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+	ASSERT(SetFlags(fterm, FLAG_NONBLOCK)==0);
+	ASSERT(SetFlags(fterm, FLAG_PACKET)==-1);
+
+	/* Reading */
+	ASSERT(Read(fterm, buf, 100) == WOULDBLOCK);
+	sendme(0, "hello");
+	pollfid_t pf = { fterm, EV_READ, 0 };
+	ASSERT(Poll(&pf, 1, (timeout_t)-1) == 1);
+	int n = 0;
+	while(n < 5) {
+		int rc = Read(fterm, buf+n, 100);
+		ASSERT(rc > 0 || rc == WOULDBLOCK);
+		if(rc > 0) n += rc;
+	}
+	ASSERT(memcmp(buf, "hello", 5)==0);
+	ASSERT(Read(fterm, buf, 100) == WOULDBLOCK);
+
+	/* Writing: nothing reads the console, so it fills up */
+	memset(buf, 'x', sizeof(buf));
+	int total = 0, rc = 0;
+	for(int k=0; k<1000; k++) {
+		rc = Write(fterm, buf, sizeof(buf));
+		if(rc == WOULDBLOCK) break;
+		ASSERT(rc > 0);
+		total += rc;
+	}
+	ASSERT(rc == WOULDBLOCK);
+	ASSERT(total > 0);
+
+	/* Drain it; a blocking write returns when everything before it is sent */
+	char piece[1025];
+	memset(piece, 'x', 1024);
+	piece[1024] = '\0';
+	for(; total >= 1024; total -= 1024)
+		expect(0, piece);
+	piece[total] = '\0';
+	if(total > 0) expect(0, piece);
+	expect(0, "!");
+	ASSERT(SetFlags(fterm, 0)==0);
+	ASSERT(Write(fterm, "!", 1) == 1);
+	return 0;
+}
+
+
+static int shutdown_blocked_reader(int argl, void* args)
+{
+	Fid_t sock = *(Fid_t*)args;
+	char buf[100];
+	int rc = Read(sock, buf, 100);
+	ASSERT(rc == 0 || rc == -1);	/* -1 if it was shut down before it started */
+	return 0;
+}
+
+BOOT_TEST(test_shutdown_during_io,
+	"Test that a socket can be shut down while another thread is blocked reading it, and that the reader sees the peer close."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+
+	for(int round=0; round<10; round++) {
+		Fid_t cli = Socket(NOPORT), srv;
+		connect_sockets(cli, lsock, &srv, 100);
+
+		Tid_t r = CreateThread(shutdown_blocked_reader, sizeof(srv), &srv);
+		fibo(25);	/* Let the reader block */
+		ASSERT(ShutDown(srv, SHUTDOWN_READ)==0);
+		ASSERT(Read(srv, NULL, 0) == -1);
+
+		/* The reader still holds the pipe, and wakes up */
+		ASSERT(Close(cli)==0);
+		ASSERT(ThreadJoin(r, NULL)==0);
+		ASSERT(Close(srv)==0);
+	}
+	ASSERT(Close(lsock)==0);
+	return 0;
+}
+
 TEST_SUITE(user_tests, 
 	"These are tests defined by the user."
 	)
 {
 	&dummy_user_test,
+	&test_many_concurrent_timeouts,
+	&test_create_thread_with_stack,
+	&test_many_small_stack_threads,
+	&test_mutex_contention,
+	&test_parallel_pipes_and_exec,
+	&test_pipe_ring_wraparound,
+	&test_pipe_with_size,
+	&test_socket_handoff_transfer,
+	&test_splice,
+	&test_readv_writev,
+	&test_poll,
+	&test_event_queue,
+	&test_event_queue_close,
+	&test_nonblocking_streams,
+	&test_packet_mode,
+	&test_reuseport,
+	&test_connection_churn,
+	&test_kbd_bursts,
+	&test_kbd_block_reads,
+	&test_write_con_slow,
+	&test_nonblocking_terminal,
+	&test_shutdown_during_io,
 	NULL
 };
 